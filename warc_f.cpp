@@ -18,13 +18,47 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
+#include <string_view>
+#include <stdexcept>
+#include <vector>
 #include <algorithm>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <glob.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 // v0.2
 namespace warcfile {
 
 static const char CR=0x0d;
 static const char LF=0x0a;
+// Content is copied in chunks of CHUNK_SIZE. Records larger than STREAM_SIZE
+// are not held in memory when the input is not mapped.
+static const size_t CHUNK_SIZE=1<<22;
+static const size_t STREAM_SIZE=1<<26;
+// Part of content read for HTTP fields in l mode
+static const size_t HEAD_SIZE=1<<16;
 
 enum EnumLineTypes {
     LTYPE_NONE,LTYPE_LF,LTYPE_CRLF
@@ -61,12 +95,23 @@ enum WarcFields{
     WARC_RESOURCE_TYPE   // proposed ?
 };
 
+// Fields added in encoding, not written back in decoding.
+// FIELD_PAYLOAD_REF gives the location of a stored copy of the payload,
+// FIELD_SPLIT_NAME the split file of the content (c{i}{ext} or {i}{ext}),
+// FIELD_NORMAL how to restore normalized content (see normalizePayload).
+enum EncodedFields {
+    FIELD_NORMAL=0xfd,
+    FIELD_SPLIT_NAME=0xfe,
+    FIELD_PAYLOAD_REF=0xff
+};
+
 struct field {
     int id;
-    std::string value;
+    std::string_view value;
 };
 
-static const std::vector<field> WARC_FIELDS={
+// Ordered by id, WARC_FIELDS[id].value is the field name
+static constexpr field WARC_FIELDS[]={
     {WARC_TYPE , "WARC-Type"},
     {WARC_RECORD_ID , "WARC-Record-ID"},
     {WARC_DATE , "WARC-Date"},
@@ -97,70 +142,704 @@ static const std::vector<field> WARC_FIELDS={
     {WARC_RESOURCE_TYPE , "WARC-Resource-Type"}
 };
 
-int get_warc_field_id(std::string name) {
-    for(int i=0; i < WARC_FIELDS.size(); i++) {
-        if (WARC_FIELDS[i].value==name) return WARC_FIELDS[i].id;
-    }
-    return -1;
+static constexpr int WARC_FIELD_COUNT=sizeof(WARC_FIELDS)/sizeof(field);
+
+// Perfect hash of field names. Parameters were searched so that all names
+// in WARC_FIELDS map to different slots, which is checked at compile time.
+static constexpr int FIELD_HASH_SIZE=64;
+constexpr int field_hash(std::string_view name) {
+    return (name.size()*14+(unsigned char)name[5]*11+(unsigned char)name.back())&(FIELD_HASH_SIZE-1);
 }
-std::string get_warc_field_name(int id) {
-    for(int i=0; i < WARC_FIELDS.size(); i++) {
-        if (WARC_FIELDS[i].id==id) return WARC_FIELDS[i].value;
+struct FieldHashTable {
+    signed char slot[FIELD_HASH_SIZE];
+};
+constexpr FieldHashTable make_field_hash_table() {
+    FieldHashTable t{};
+    for (int i=0; i<FIELD_HASH_SIZE; i++) t.slot[i]=-1;
+    for (int i=0; i<WARC_FIELD_COUNT; i++) t.slot[field_hash(WARC_FIELDS[i].value)]=i;
+    return t;
+}
+static constexpr FieldHashTable FIELD_HASH=make_field_hash_table();
+constexpr bool check_field_hash_table() {
+    for (int i=0; i<WARC_FIELD_COUNT; i++) {
+        if (WARC_FIELDS[i].id!=i || FIELD_HASH.slot[field_hash(WARC_FIELDS[i].value)]!=i) return false;
     }
-    return "";
+    return true;
+}
+static_assert(check_field_hash_table(), "WARC_FIELDS not ordered by id or field_hash has collisions");
+
+inline int get_warc_field_id(std::string_view name) {
+    if (name.size()<6) return -1;
+    int id=FIELD_HASH.slot[field_hash(name)];
+    return id!=-1 && WARC_FIELDS[id].value==name?id:-1;
+}
+inline std::string_view get_warc_field_name(int id) {
+    if (id<0 || id>=WARC_FIELD_COUNT) return "";
+    return WARC_FIELDS[id].value;
+}
+
+// Error in processing a file. main prints it and exits, batch mode keeps
+// it as the result of the file.
+class WarcError: public std::runtime_error {
+    public:
+        explicit WarcError(const std::string &msg): std::runtime_error(msg) { }
+};
+
+[[noreturn]] inline void fail(const char *format, ...) {
+    char msg[1024];
+    va_list args;
+    va_start(args,format);
+    vsnprintf(msg,sizeof(msg),format,args);
+    va_end(args);
+    throw WarcError(msg);
+}
+
+// Input that is processed anyway is reported here, printed unless the
+// handler is replaced (library use).
+inline std::function<void(const std::string &)> warnings=[](const std::string &msg) { fprintf(stderr,"%s\n",msg.c_str()); };
+
+inline void warn(const char *format, ...) {
+    char msg[1024];
+    va_list args;
+    va_start(args,format);
+    vsnprintf(msg,sizeof(msg),format,args);
+    va_end(args);
+    if (warnings) warnings(msg);
+}
+
+// Ids are the first byte of encoded header lines, 0xfc and up are not fields
+static const int FIELD_ID_LIMIT=0xfc;
+
+// k-th id that can start an encoded header line, CR, LF and ':' are skipped
+inline int lineId(int k) {
+    for (int c:{LF,CR,':'}) if (k>=c) k++;
+    return k;
+}
+
+// Field names of a file. Names not in WARC_FIELDS (WARC/1.1 proposals,
+// vendor fields) get ids from WARC_FIELD_COUNT up in order of appearance.
+class FieldNames {
+    private:
+        std::vector<std::string> names;
+        std::map<std::string,int,std::less<>> ids;
+    public:
+        int Id(std::string_view name) {
+            int id=get_warc_field_id(name);
+            if (id!=-1 && id!=WARC_RESERVED1 && id!=WARC_RESERVED2) return id;
+            // an empty line would end the dictionary
+            if (name.size()==0) fail("Empty field name");
+            auto it=ids.find(name);
+            if (it!=ids.end()) return it->second;
+            id=WARC_FIELD_COUNT+names.size();
+            if (id>=':') id++;
+            if (id>=FIELD_ID_LIMIT) fail("Too many field names, %.*s",int(name.size()),name.data());
+            names.emplace_back(name);
+            ids.emplace(std::string(name),id);
+            return id;
+        }
+        std::string_view Name(int id) const {
+            if (id<WARC_FIELD_COUNT) return get_warc_field_name(id);
+            size_t k=id-WARC_FIELD_COUNT-(id>':');
+            return k<names.size()?std::string_view(names[k]):std::string_view();
+        }
+};
+
+// Worker threads running queued tasks in order of submission.
+// Tasks not yet started are dropped on destruction.
+class ThreadPool {
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex lock;
+        std::condition_variable cv;
+        std::condition_variable idle;
+        size_t active;
+        bool stop;
+        void Work() {
+            while (true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> l(lock);
+                    cv.wait(l, [this]{ return stop || !tasks.empty(); });
+                    if (stop) return;
+                    task=std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+                std::lock_guard<std::mutex> l(lock);
+                active--;
+                idle.notify_all();
+            }
+        }
+    public:
+        explicit ThreadPool(int n): active(0),stop(false) {
+            if (n<1) n=1;
+            for (int i=0; i<n; i++) workers.emplace_back(&ThreadPool::Work,this);
+        }
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                stop=true;
+            }
+            cv.notify_all();
+            for (auto &w:workers) w.join();
+        }
+        void Run(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                tasks.push_back(std::move(task));
+                active++;
+            }
+            cv.notify_one();
+        }
+        // Wait until at most n tasks are queued or running
+        void Wait(size_t n=0) {
+            std::unique_lock<std::mutex> l(lock);
+            idle.wait(l, [this,n]{ return active<=n; });
+        }
+        int Size() { return workers.size(); }
+};
+
+static int DefaultThreads() {
+    int n=std::thread::hardware_concurrency();
+    return n>0?n:1;
 }
 
+// One gzip member of mapped input. Inflated up to MEMBER_LIMIT bytes by a
+// worker, the rest is inflated by the reader as it is consumed.
+struct GzipMember {
+    size_t start;
+    size_t in;
+    std::string out;
+    z_stream zs;
+    bool open;
+    bool done;
+    bool error;
+    std::atomic<bool> ready;
+    std::mutex lock;
+    std::condition_variable cv;
+    explicit GzipMember(size_t pos): start(pos),in(pos),open(false),done(false),error(false),ready(false) { }
+    ~GzipMember() { if (open) inflateEnd(&zs); }
+    // Inflate until the member ends or out has limit bytes
+    void Inflate(const char *map, size_t size, size_t limit) {
+        if (!open) {
+            memset(&zs,0,sizeof(zs));
+            if (inflateInit2(&zs,16+MAX_WBITS)!=Z_OK) {
+                error=true;
+                return;
+            }
+            open=true;
+        }
+        const size_t CHUNK=1<<16;
+        while (out.size()<limit) {
+            size_t olen=out.size();
+            out.resize(olen+CHUNK);
+            zs.next_in=(Bytef *)map+in;
+            zs.avail_in=uInt(std::min(size-in,size_t(1)<<30));
+            zs.next_out=(Bytef *)&out[olen];
+            zs.avail_out=CHUNK;
+            int ret=inflate(&zs,Z_NO_FLUSH);
+            in=(const char *)zs.next_in-map;
+            out.resize(olen+CHUNK-zs.avail_out);
+            if (ret==Z_STREAM_END) {
+                done=true;
+                break;
+            }
+            if (ret!=Z_OK && ret!=Z_BUF_ERROR) {
+                error=true;
+                break;
+            }
+            if (ret==Z_BUF_ERROR && in==size) {
+                error=true;
+                break;
+            }
+        }
+        if (done || error) inflateEnd(&zs),open=false;
+    }
+};
+
+// Mapped gzip input with one or more members. Member starts are guessed by
+// scanning for gzip headers and inflated ahead in parallel. Results are
+// consumed in file order from the end of the previous member, so guesses
+// that fall inside compressed data are never used. Members are queued up to
+// 2*MEMBER_LIMIT inflated bytes per thread, compressed pages that were
+// consumed are released.
+class GzipMembers {
+    private:
+        static const size_t MEMBER_LIMIT=1<<22;
+        const char *map;
+        size_t size;
+        bool release;     // map is a file mapping of the reader
+        size_t released;
+        size_t next;
+        size_t scan;
+        std::map<size_t,std::shared_ptr<GzipMember>> jobs;
+        std::shared_ptr<GzipMember> cur;
+        size_t curpos;
+        size_t inflated;  // bytes returned by Read
+        bool log;         // member starts are kept for Find
+        std::deque<std::pair<size_t,size_t>> starts;   // inflated and compressed start
+        std::mutex loglock;
+        ThreadPool pool;
+        bool IsHeader(size_t p) {
+            return p+10<=size && (unsigned char)map[p]==0x1f && (unsigned char)map[p+1]==0x8b && map[p+2]==8 && (map[p+3]&0xe0)==0;
+        }
+        // Inflated bytes of queued members, MEMBER_LIMIT for those not ready
+        size_t Queued() {
+            size_t n=0;
+            for (auto &j:jobs) n+=j.second->ready?j.second->out.size():MEMBER_LIMIT;
+            return n;
+        }
+        void Schedule() {
+            size_t queued=Queued();
+            while (queued+MEMBER_LIMIT<=size_t(pool.Size())*2*MEMBER_LIMIT && jobs.size()<size_t(pool.Size())*64 && scan<size) {
+                const char *p=(const char *)memchr(map+scan,0x1f,size-scan);
+                if (p==NULL) {
+                    scan=size;
+                    break;
+                }
+                size_t pos=p-map;
+                scan=pos+1;
+                if (!IsHeader(pos)) continue;
+                auto m=std::make_shared<GzipMember>(pos);
+                jobs[pos]=m;
+                queued+=MEMBER_LIMIT;
+                const char *data=map;
+                size_t len=size;
+                pool.Run([m,data,len] {
+                    m->Inflate(data,len,MEMBER_LIMIT);
+                    std::lock_guard<std::mutex> l(m->lock);
+                    m->ready=true;
+                    m->cv.notify_all();
+                });
+            }
+        }
+        // Member starting at next, inflated by a worker if it was found by the scan
+        std::shared_ptr<GzipMember> Take() {
+            while (!jobs.empty() && jobs.begin()->first<next) jobs.erase(jobs.begin());
+            if (scan<next) scan=next;
+            std::shared_ptr<GzipMember> m;
+            auto it=jobs.find(next);
+            if (it!=jobs.end()) {
+                m=it->second;
+                jobs.erase(it);
+                Schedule();
+                std::unique_lock<std::mutex> l(m->lock);
+                m->cv.wait(l, [&m]{ return m->ready.load(); });
+            } else {
+                Schedule();
+                m=std::make_shared<GzipMember>(next);
+                m->Inflate(map,size,MEMBER_LIMIT);
+            }
+            return m;
+        }
+        // Drop compressed pages before pos, they are read back if used again
+        void Release(size_t pos) {
+            size_t len=pos&~size_t(0xfff);
+            if (!release || len<released+MEMBER_LIMIT) return;
+            madvise(const_cast<char *>(map)+released,len-released,MADV_DONTNEED);
+            released=len;
+        }
+    public:
+        // Pages of data are released if release is true, member starts
+        // are kept if log is true
+        GzipMembers(const char *data, size_t len, int threads, bool release, bool log=false): map(data),size(len),release(release),released(0),next(0),scan(0),curpos(0),inflated(0),log(log),pool(threads) { }
+        // Read up to len bytes of inflated data, returns 0 at end of input
+        size_t Read(char *dst, size_t len) {
+            size_t total=0;
+            while (total<len) {
+                if (cur!=nullptr && curpos<cur->out.size()) {
+                    size_t n=std::min(len-total,cur->out.size()-curpos);
+                    memcpy(dst+total,&cur->out[curpos],n);
+                    total+=n,curpos+=n,inflated+=n;
+                    continue;
+                }
+                if (cur!=nullptr && !cur->done && !cur->error) {
+                    cur->out.clear(),curpos=0;
+                    cur->Inflate(map,size,MEMBER_LIMIT);
+                    Release(cur->in);
+                    continue;
+                }
+                if (cur!=nullptr) {
+                    if (cur->error) {
+                        warn("Bad gzip data at %zu",cur->start);
+                        next=size;
+                    } else next=cur->in;
+                    cur=nullptr;
+                    Release(next);
+                }
+                if (next>=size) break;
+                if (!IsHeader(next)) {
+                    warn("Unexpected data after gzip member at %zu",next);
+                    next=size;
+                    break;
+                }
+                cur=Take(),curpos=0;
+                if (log) {
+                    std::lock_guard<std::mutex> l(loglock);
+                    starts.emplace_back(inflated,cur->start);
+                }
+            }
+            return total;
+        }
+        // Compressed offset and inflated start of the member with inflated
+        // position pos. Positions are asked in order, earlier members are dropped.
+        bool Find(size_t pos, size_t &start, size_t &inflatedStart) {
+            if (!log) return false;
+            std::lock_guard<std::mutex> l(loglock);
+            while (starts.size()>1 && starts[1].first<=pos) starts.pop_front();
+            if (starts.empty() || starts[0].first>pos) return false;
+            inflatedStart=starts[0].first,start=starts[0].second;
+            return true;
+        }
+};
+
+// Bounded queue between one producer and one consumer thread. Slots are
+// passed with atomic indexes, a thread only sleeps on the condition
+// variable when the queue is full (producer) or empty (consumer).
+// Close ends the queue from either side: Push fails, Pop drains the queue.
+template<typename T>
+class SpscQueue {
+    private:
+        std::vector<T> slots;
+        std::atomic<size_t> head;   // next slot to pop
+        std::atomic<size_t> tail;   // next slot to push
+        std::atomic<int> sleeping;
+        std::atomic<bool> closed;
+        std::mutex lock;
+        std::condition_variable cv;
+        template<typename P> void Wait(P ready) {
+            for (int k=0; k<64; k++) {
+                if (ready()) return;
+                std::this_thread::yield();
+            }
+            sleeping++;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                cv.wait(l,ready);
+            }
+            sleeping--;
+        }
+        void Wake() {
+            if (sleeping==0) return;
+            std::lock_guard<std::mutex> l(lock);
+            cv.notify_all();
+        }
+    public:
+        explicit SpscQueue(size_t n): slots(n),head(0),tail(0),sleeping(0),closed(false) { }
+        bool Push(T &&value) {
+            Wait([this]{ return tail-head<slots.size() || closed; });
+            if (closed) return false;
+            slots[tail%slots.size()]=std::move(value);
+            tail++;
+            Wake();
+            return true;
+        }
+        // false when the queue is closed and empty
+        bool Pop(T &value) {
+            Wait([this]{ return tail!=head || closed; });
+            if (tail==head) return false;
+            value=std::move(slots[head%slots.size()]);
+            head++;
+            Wake();
+            return true;
+        }
+        void Close() {
+            closed=true;
+            std::lock_guard<std::mutex> l(lock);
+            cv.notify_all();
+        }
+};
+
+// Reader stage of buffered input. A thread fills blocks with read and
+// queues them, Read copies them out in order.
+class ReadAhead {
+    private:
+        static const size_t BLOCK_SIZE=1<<22;
+        SpscQueue<std::string> queue;
+        std::string cur;
+        size_t curpos;
+        std::thread worker;
+    public:
+        explicit ReadAhead(std::function<size_t(char *, size_t)> read): queue(4),curpos(0) {
+            worker=std::thread([this,read] {
+                while (true) {
+                    std::string block(BLOCK_SIZE,0);
+                    size_t len=read(&block[0],block.size());
+                    if (len==0) break;
+                    block.resize(len);
+                    if (queue.Push(std::move(block))==false) break;
+                }
+                queue.Close();
+            });
+        }
+        ~ReadAhead() {
+            queue.Close();
+            worker.join();
+        }
+        // Read up to len bytes, returns 0 at end of input
+        size_t Read(char *dst, size_t len) {
+            size_t total=0;
+            while (total<len) {
+                if (curpos==cur.size()) {
+                    curpos=0;
+                    cur.clear();
+                    if (queue.Pop(cur)==false) break;
+                }
+                size_t n=std::min(len-total,cur.size()-curpos);
+                memcpy(dst+total,&cur[curpos],n);
+                total+=n,curpos+=n;
+            }
+            return total;
+        }
+};
+
+// Input is memory mapped when possible, otherwise buffered. Gzip input
+// (.warc.gz) is detected and inflated into the buffer, in parallel when the
+// compressed file is mapped. Lines and blocks are returned as views into
+// the mapping or the buffer. Views into the buffer are valid until the next
+// read, views into the mapping until close. With read ahead buffered input
+// is read by a ReadAhead thread and mapped input is prefetched by the kernel.
+// Input can also be a buffer of the caller, read like a mapped file, or a
+// function of the caller, read like a pipe.
 class Reader{
     private:
+        static const size_t BUFFER_SIZE=1<<22;
+        static const size_t RELEASE_SIZE=1<<26;
         std::string file_name;
         FILE *in;
-        std::string line;
+        gzFile gz;
+        std::unique_ptr<GzipMembers> members;
+        std::unique_ptr<ReadAhead> ahead;
+        std::function<size_t(char *, size_t)> read;  // input function of the caller
+        std::vector<char> buf;
+        const char *base;
+        char *map;
+        size_t mapsize;
+        bool borrowed;    // map is a buffer of the caller
+        bool direct;      // reading the mapped file without buffer
+        bool prefetch;    // read ahead of mapped input
+        size_t released;
+        size_t keep;      // read bytes of the mapping kept before release
+        size_t offset;    // input position of base[0]
+        size_t pos,end;
+        std::string_view line;
         EnumLineTypes linetype;
-        std::string block;
+        std::string_view block;
+        std::string at;
         bool isEOF;
+        // Move unread data to the front of the buffer and read more.
+        // Buffer grows when it is full of unread data.
+        bool Fill() {
+            if (direct) return false;
+            if (pos>0) {
+                memmove(buf.data(),buf.data()+pos,end-pos);
+                offset+=pos;
+                end-=pos,pos=0;
+            }
+            if (end==buf.size()) buf.resize(buf.size()*2);
+            size_t len=ahead!=nullptr?ahead->Read(buf.data()+end,buf.size()-end):Source(buf.data()+end,buf.size()-end);
+            end+=len;
+            base=buf.data();
+            return len>0;
+        }
+        size_t Source(char *dst, size_t len) {
+            if (members!=nullptr) return members->Read(dst,len);
+            if (read) return read(dst,len);
+            if (in==NULL) return 0;
+            if (gz==NULL) return fread(dst,1,len,in);
+            int n=gzread(gz,dst,unsigned(std::min(len,size_t(1)<<30)));
+            return n>0?n:0;
+        }
+        // Drop mapped pages that were already read. They are read back from
+        // the file if an old view is used again. With read ahead the pages
+        // up to RELEASE_SIZE past the read position are requested.
+        void Release() {
+            if (!direct || borrowed || pos-released<keep) return;
+            size_t len=pos&~size_t(0xfff);
+            madvise(map+released,len-released,MADV_DONTNEED);
+            released=len;
+            if (prefetch && len<mapsize) madvise(map+len,std::min(2*RELEASE_SIZE,mapsize-len),MADV_WILLNEED);
+        }
     public:
-        explicit Reader(std::string filename): file_name(filename),isEOF(false) {
+        // gzip input is inflated unless gzip is false
+        // gzip member offsets are kept for Member if offsets is true
+        explicit Reader(std::string filename, int threads=DefaultThreads(), bool gzip=true, bool readAhead=false, bool offsets=false): file_name(filename),gz(NULL),base(NULL),map(NULL),mapsize(0),borrowed(false),direct(false),prefetch(false),released(0),keep(RELEASE_SIZE),offset(0),pos(0),end(0),isEOF(false) {
             in=fopen(file_name.c_str(),"rb");
-            if (in==NULL) {
-               printf("Input file not found.");
-               exit(1);
+            if (in==NULL) fail("Input file not found: %s",file_name.c_str());
+            struct stat st;
+            if (fstat(fileno(in),&st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+                void *p=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fileno(in),0);
+                if (p!=MAP_FAILED) {
+                    map=(char *)p,mapsize=st.st_size;
+                    madvise(map,mapsize,MADV_SEQUENTIAL);
+                    base=map,end=mapsize;
+                }
             }
+            Open(threads,gzip,readAhead,offsets);
         };
-        std::string const &ReadLine() {
-            line="";
+        // Buffer of the caller, valid until close. Gzip data is inflated.
+        Reader(const char *data, size_t size, int threads=DefaultThreads()): file_name("buffer"),in(NULL),gz(NULL),base(data),map(const_cast<char *>(data)),mapsize(size),borrowed(true),direct(false),prefetch(false),released(0),keep(RELEASE_SIZE),offset(0),pos(0),end(size),isEOF(false) {
+            if (size==0) map=NULL;
+            Open(threads,true,false);
+        }
+        // Function of the caller that copies up to len bytes of input to dst
+        // and returns their number, 0 at end of input. Gzip data is not inflated.
+        explicit Reader(std::function<size_t(char *, size_t)> f): file_name("stream"),in(NULL),gz(NULL),read(f),base(NULL),map(NULL),mapsize(0),borrowed(false),direct(false),prefetch(false),released(0),keep(RELEASE_SIZE),offset(0),pos(0),end(0),isEOF(false) {
+            Open(1,false,false);
+        }
+        void Open(int threads, bool gzip, bool readAhead, bool offsets=false) {
+            if (gzip && map!=NULL && mapsize>=2 && (unsigned char)map[0]==0x1f && (unsigned char)map[1]==0x8b) {
+                members.reset(new GzipMembers(map,mapsize,threads,!borrowed,offsets));
+                base=NULL,end=0;
+            } else if (gzip && map==NULL && in!=NULL) {
+                // gzread passes data that is not gzip through as is
+                gz=gzdopen(dup(fileno(in)),"rb");
+                gzbuffer(gz,1<<20);
+            }
+            direct=map!=NULL && members==nullptr;
+            if (!direct) buf.resize(BUFFER_SIZE),base=buf.data();
+            if (readAhead && direct && !borrowed) prefetch=true,madvise(map,std::min(2*RELEASE_SIZE,mapsize),MADV_WILLNEED);
+            else if (readAhead) ahead.reset(new ReadAhead([this](char *dst, size_t len) { return Source(dst,len); }));
+        }
+        std::string_view ReadLine() {
+            Release();
             linetype=LTYPE_NONE;
-            int c=0;
-            while ((c=getc(in))!=EOF) {
-                line=line+char(c);
-                if (c==CR) line.pop_back(),linetype=LTYPE_CRLF;
-                else if (c==LF) {
-                    if (linetype!=LTYPE_CRLF) linetype=LTYPE_LF;
-                    line.pop_back();
-                    break;
-                }
+            size_t scan=0;
+            const char *p;
+            while ((p=(const char *)memchr(base+pos+scan,LF,end-pos-scan))==NULL) {
+                scan=end-pos;
+                if (Fill()==false) break;
             }
-            isEOF=c==EOF;
+            size_t len=p!=NULL?p-(base+pos):end-pos;
+            line=std::string_view(base+pos,len);
+            pos+=p!=NULL?len+1:len;
+            if (line.size()>0 && line.back()==CR) line.remove_suffix(1),linetype=LTYPE_CRLF;
+            else if (p!=NULL) linetype=LTYPE_LF;
+            isEOF=p==NULL;
             return line;
         }
-        std::string const &ReadBlock(int size) {
-            block="";
-            block.resize(size);
-            int len=fread(&block[0],1,size,in);
+        std::string_view ReadBlock(size_t size) {
+            Release();
+            while (end-pos<size && Fill());
+            size_t len=std::min(size,end-pos);
             if (len!=size) isEOF=true;
-            block.resize(len);
+            block=std::string_view(base+pos,len);
+            pos+=len;
             return block;
         }
-        std::string const &LastLine() { return line;}
+        // Block at input position off, does not change the read position.
+        // Not available for gzip input.
+        std::string_view ReadAt(size_t off, size_t size) {
+            if (direct) return std::string_view(map+std::min(off,mapsize),std::min(size,mapsize-std::min(off,mapsize)));
+            if (members!=nullptr || (gz!=NULL && gzdirect(gz)==0)) fail("Can not read at offset in gzip input");
+            if (in==NULL) fail("Can not read at offset in %s",file_name.c_str());
+            at.resize(size);
+            ssize_t len=pread(fileno(in),&at[0],size,off);
+            at.resize(len>0?len:0);
+            return at;
+        }
+        // Release read pages of mapped input every size bytes, for
+        // readers of which several are open at once
+        void Keep(size_t size) { keep=size; }
+        std::string_view LastLine() { return line;}
         EnumLineTypes const LineType() { return linetype;}
+        // Views stay valid until close
+        bool Mapped() { return direct; }
+        const char *Base() { return direct?map:NULL; }
         bool End() { return isEOF; }
-        void close() {fclose(in); }
-        void seek(int len) {fseek(in, len, SEEK_CUR); }
+        std::string const &Name() { return file_name; }
+        // Position in input, for gzip input in the inflated data
+        size_t Tell() { return offset+pos; }
+        // Compressed offset and inflated start of the gzip member with inflated
+        // position pos, false if member offsets are not kept
+        bool Member(size_t pos, size_t &start, size_t &inflated) { return members!=nullptr && members->Find(pos,start,inflated); }
+        Reader(const Reader &)=delete;
+        ~Reader() { close(); }
+        void close() {
+            ahead.reset();
+            members.reset();
+            if (gz!=NULL) gzclose(gz),gz=NULL;
+            if (map!=NULL && !borrowed) munmap(map,mapsize);
+            map=NULL;
+            if (in!=NULL) fclose(in),in=NULL;
+        }
+        void seek(size_t len) {
+            if (len<=end-pos) {
+                pos+=len;
+                return;
+            }
+            len-=end-pos;
+            offset+=end;
+            pos=end=0;
+            if (direct) pos=end=mapsize,offset=0;
+            else if (ahead==nullptr && gz!=NULL && gzseek(gz,z_off_t(len),SEEK_CUR)!=-1) offset+=len;
+            else if (ahead==nullptr && members==nullptr && in!=NULL && fseeko(in,off_t(len),SEEK_CUR)==0) offset+=len;
+            else while (len>0 && Fill()) {
+                size_t n=std::min(len,end);
+                pos=n,len-=n;
+            }
+        }
+};
+
+// Writer stage of an output file. Writes to File() are buffered in blocks
+// and queued, a thread writes them to out. Without on File() is out.
+class WriteBehind {
+    private:
+        static constexpr size_t BLOCK_SIZE=1<<22;
+        FILE *out;
+        FILE *file;
+        SpscQueue<std::string> queue;
+        std::thread worker;
+        std::atomic<bool> error;
+        static ssize_t Write(void *cookie, const char *data, size_t size) {
+            WriteBehind *w=(WriteBehind *)cookie;
+            for (size_t k=0; k<size; k+=BLOCK_SIZE) {
+                if (w->queue.Push(std::string(data+k,std::min(BLOCK_SIZE,size-k)))==false) return 0;
+            }
+            return size;
+        }
+        void Stop() {
+            if (file==out) return;
+            fclose(file);
+            file=out;
+            queue.Close();
+            worker.join();
+        }
+    public:
+        WriteBehind(FILE *o, bool on): out(o),file(o),queue(4),error(false) {
+            if (on==false || out==NULL) return;
+            cookie_io_functions_t io={NULL,Write,NULL,NULL};
+            file=fopencookie(this,"w",io);
+            if (file==NULL) {
+                file=out;
+                return;
+            }
+            setvbuf(file,NULL,_IOFBF,BLOCK_SIZE);
+            worker=std::thread([this] {
+                std::string block;
+                while (queue.Pop(block)) {
+                    if (fwrite(block.data(),1,block.size(),out)!=block.size()) error=true;
+                }
+            });
+        }
+        WriteBehind(const WriteBehind &)=delete;
+        ~WriteBehind() { Stop(); }
+        FILE *File() { return file; }
+        // Write out queued blocks, out stays open
+        void Close() {
+            Stop();
+            if (error) fail("Write error");
+        }
 };
 
+// Field values are offset/length pairs into the mapped input or,
+// when the input is not mapped, into the record's own header copy.
 class WarcField {
     public:
-        std::string value;
         int id;
+        size_t offset;
+        size_t size;
         WarcField() { };
 };
 
@@ -168,15 +847,132 @@ class WarcRecord {
     public:
         std::string version;
         std::vector<WarcField> fields;
-        std::string content;
-        WarcRecord() { };
+        const char *data;
+        std::string header;
+        std::string_view content;
+        size_t offset;       // position of record in input
+        size_t headerSize;   // version line, fields and empty line
+        size_t contentSize;
+        bool stream;         // content is not read, see WarcFile::StreamContent
+        WarcRecord(): version("WARC/1.0"),data(NULL),offset(0),headerSize(0),contentSize(0),stream(false) { };
+        std::string_view Value(int j) const {
+            return std::string_view((data!=NULL?data:header.data())+fields[j].offset,fields[j].size);
+        }
+        // index of first field with id or -1
+        int Find(int id) const {
+            for(int j=0; j<int(fields.size()); j++) {
+                if (fields[j].id==id) return j;
+            }
+            return -1;
+        }
+        void Clear(const char *base) {
+            fields.clear();
+            header.clear();
+            content=std::string_view();
+            contentSize=0;
+            stream=false;
+            data=base;
+        }
+        // Add field with value from line after pos
+        void Add(int id, std::string_view line, size_t pos) {
+            WarcField field;
+            field.id=id;
+            field.size=line.size()-pos;
+            if (data!=NULL) {
+                field.offset=line.data()+pos-data;
+            } else {
+                field.offset=header.size();
+                header.append(line.data()+pos,field.size);
+            }
+            fields.push_back(field);
+        }
+};
+
+// Headers of many records in one arena. Values are appended to blocks of
+// BLOCK_SIZE that are never moved, each record is a range of packed
+// (id, offset, length) entries with offsets from the record start. A record
+// costs its values and 12 bytes per field with no allocation of its own.
+// Ids other than WARC fields can be used for derived values.
+class RecordStore {
+    private:
+        static constexpr size_t BLOCK_SIZE=1<<20;
+        struct Entry {
+            uint32_t offset;
+            uint32_t size;
+            uint8_t id;
+        };
+        struct Stored {
+            const char *data;   // record values
+            size_t first;       // first entry
+            size_t offset;      // position of record in input
+            size_t headerSize;
+        };
+        std::vector<std::unique_ptr<char[]>> blocks;
+        size_t used;            // bytes used of the last block
+        size_t size;            // size of the last block
+        std::vector<Entry> entries;
+        std::vector<Stored> records;
+    public:
+        RecordStore(): used(0),size(0) { }
+        RecordStore(RecordStore &&)=default;
+        RecordStore &operator=(RecordStore &&)=default;
+        RecordStore(const RecordStore &)=delete;
+        // Add fields of record, only fields in ids unless ids is empty
+        void Add(const WarcRecord &record, const std::vector<int> &ids={}) {
+            size_t len=0;
+            for (size_t j=0; j<record.fields.size(); j++) len+=record.fields[j].size;
+            records.push_back({NULL,entries.size(),record.offset,record.headerSize});
+            Reserve(len);
+            for (size_t j=0; j<record.fields.size(); j++) {
+                int id=record.fields[j].id;
+                if (ids.size()>0 && std::find(ids.begin(),ids.end(),id)==ids.end()) continue;
+                Add(id,record.Value(j));
+            }
+        }
+        // Room for len more bytes of the last record in the current block
+        void Reserve(size_t len) {
+            Stored &last=records.back();
+            size_t start=last.data!=NULL?last.data-blocks.back().get():used;
+            if (blocks.size()>0 && used+len<=size) {
+                if (last.data==NULL) last.data=blocks.back().get()+used;
+                return;
+            }
+            // the record moves to a new block with its values so far
+            size_t n=std::max(BLOCK_SIZE,used-start+len);
+            std::unique_ptr<char[]> block(new char[n]);
+            if (last.data!=NULL) memcpy(block.get(),last.data,used-start);
+            used=last.data!=NULL?used-start:0;
+            size=n;
+            blocks.push_back(std::move(block));
+            last.data=blocks.back().get();
+        }
+        // Add field to the last record
+        void Add(int id, std::string_view value) {
+            Reserve(value.size());
+            size_t offset=blocks.back().get()+used-records.back().data;
+            if (offset+value.size()>UINT32_MAX) fail("Record header too large");
+            entries.push_back({uint32_t(offset),uint32_t(value.size()),uint8_t(id)});
+            memcpy(blocks.back().get()+used,value.data(),value.size());
+            used+=value.size();
+        }
+        size_t Size() const { return records.size(); }
+        size_t Offset(size_t r) const { return records[r].offset; }
+        size_t HeaderSize(size_t r) const { return records[r].headerSize; }
+        // Value of first field with id in record r, empty if none
+        std::string_view Value(size_t r, int id) const {
+            size_t last=r+1<records.size()?records[r+1].first:entries.size();
+            for (size_t k=records[r].first; k<last; k++) {
+                if (entries[k].id==id) return std::string_view(records[r].data+entries[k].offset,entries[k].size);
+            }
+            return std::string_view();
+        }
 };
-std::string SplitString(std::string linef, char spilt, int i) {
+inline std::string SplitString(std::string linef, char spilt, int i) {
     auto p=std::find(linef.begin(), linef.end(), spilt);
     std::string fieldn1="";
     std::string fieldn2="";
     std::move(linef.begin(), p, std::back_inserter(fieldn1));
-    p++; // ':'
+    if (p!=linef.end()) p++; // ':'
     std::move(p, linef.end(), std::back_inserter(fieldn2));
     if (i==0) {
         return fieldn1;
@@ -185,7 +981,7 @@ std::string SplitString(std::string linef, char spilt, int i) {
     }else return "";
                     
 }
-std::string mimeToExt(std::string file) {
+inline std::string mimeToExt(std::string file) {
     std::string ext="";
     std::transform(file.begin(), file.end(), file.begin(), [](unsigned char c){ return std::tolower(c); });
     if (file=="jpeg") ext=".jpg";
@@ -214,384 +1010,3107 @@ std::string mimeToExt(std::string file) {
     return ext;
 }
 
-void writeContent(std::string filename,std::string content){
+// Field value without leading and trailing white space
+inline std::string_view trimValue(std::string_view value) {
+    while (value.size()>0 && (value[0]==' ' || value[0]=='\t')) value.remove_prefix(1);
+    while (value.size()>0 && (value.back()==' ' || value.back()=='\t')) value.remove_suffix(1);
+    return value;
+}
+
+// Sort key of URI in SURT form: http://www.Example.com:80/a -> com,example)/a
+inline std::string surtKey(std::string_view uri) {
+    uri=trimValue(uri);
+    if (uri.size()>1 && uri[0]=='<' && uri.back()=='>') uri=uri.substr(1,uri.size()-2);
+    std::string key;
+    size_t p=uri.find("://");
+    if (p==std::string_view::npos) {
+        key=uri;
+    } else {
+        std::string_view scheme=uri.substr(0,p);
+        uri.remove_prefix(p+3);
+        size_t e=std::min(uri.find_first_of("/?#"),uri.size());
+        std::string_view host=uri.substr(0,e);
+        uri.remove_prefix(e);
+        size_t at=host.find('@');
+        if (at!=std::string_view::npos) host.remove_prefix(at+1);
+        size_t colon=host.rfind(':');
+        if (colon!=std::string_view::npos) {
+            std::string_view port=host.substr(colon+1);
+            if ((port=="80" && scheme=="http") || (port=="443" && scheme=="https")) host=host.substr(0,colon);
+        }
+        if (host.size()>4 && (host.substr(0,4)=="www." || host.substr(0,4)=="WWW.")) host.remove_prefix(4);
+        while (host.size()>0) {
+            size_t dot=host.rfind('.');
+            if (dot==std::string_view::npos) dot=0; else dot++;
+            key.append(host.substr(dot));
+            host=host.substr(0,dot>0?dot-1:0);
+            if (host.size()>0) key+=',';
+        }
+        key+=')';
+        if (uri.size()==0) key+='/';
+        key.append(uri);
+    }
+    std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c){ return std::tolower(c); });
+    for (auto &c:key) if (c==' ') c='+';
+    return key;
+}
+
+// WARC-Date 2024-01-02T03:04:05Z as 20240102030405
+inline std::string cdxDate(std::string_view date) {
+    std::string t;
+    for (auto c:trimValue(date)) if (c>='0' && c<='9') t+=c;
+    t.resize(14,'0');
+    return t;
+}
+
+// Value of number or plain string key in one line JSON object
+inline std::string jsonValue(std::string_view json, std::string_view key) {
+    std::string k="\""+std::string(key)+"\":";
+    size_t p=json.find(k);
+    if (p==std::string_view::npos) return "";
+    json.remove_prefix(p+k.size());
+    if (json.size()>0 && json[0]=='"') {
+        std::string v;
+        for (size_t i=1; i<json.size() && json[i]!='"'; i++) {
+            if (json[i]=='\\' && i+1<json.size()) i++;
+            v+=json[i];
+        }
+        return v;
+    }
+    return std::string(json.substr(0,std::min(json.find_first_of(",}"),json.size())));
+}
+
+inline std::string jsonString(std::string_view value) {
+    std::string s="\"";
+    for (unsigned char c:value) {
+        if (c=='"' || c=='\\') s+='\\',s+=c;
+        else if (c<0x20) {
+            char hex[8];
+            snprintf(hex,sizeof(hex),"\\u%04x",c);
+            s+=hex;
+        } else s+=c;
+    }
+    return s+"\"";
+}
+
+inline void writeContent(std::string filename,std::string_view content){
     FILE *out=fopen(filename.c_str(), "wb");
-    fwrite(&content[0],1,content.size(),out);
+    fwrite(content.data(),1,content.size(),out);
     fclose(out);
 }
-int readContent(std::string filename,std::string &content, int len) {
+inline size_t readContent(std::string filename,std::string &content, size_t len) {
     content.resize(len);
     FILE *in=fopen(filename.c_str(), "rb");
-    int size=fread(&content[0],1,len,in);  
+    size_t size=fread(&content[0],1,len,in);  
     fclose(in);
     return size;
 }
-std::string readFile(std::string filename) {
+inline std::string readFile(std::string filename) {
     std::string content="";
     FILE *in=fopen(filename.c_str(), "rb");
     if (in==NULL) {
         return "";
     }
-    fseek(in, 0, SEEK_END);
-    int len=ftell(in);
+    fseeko(in, 0, SEEK_END);
+    off_t len=ftello(in);
     fseeko(in, 0, SEEK_SET);
-    content.resize(len);
-    int size=fread(&content[0],1,len,in);  
+    content.resize(len>0?len:0);
+    size_t size=fread(&content[0],1,content.size(),in);  
+    content.resize(size);
     fclose(in);
     return content;
 }
+// Remove directory dir with the files in it
+inline void removeDir(std::string dir) {
+    if (dir.size()>0 && dir.back()!='/') dir+='/';
+    DIR *d=opendir(dir.c_str());
+    struct dirent *e;
+    while (d!=NULL && (e=readdir(d))!=NULL) {
+        if (strcmp(e->d_name,".")!=0 && strcmp(e->d_name,"..")!=0) unlink((dir+e->d_name).c_str());
+    }
+    if (d!=NULL) closedir(d);
+    rmdir(dir.c_str());
+}
+// Copy file to out in chunks
+inline size_t copyFile(std::string filename, FILE *out) {
+    FILE *in=fopen(filename.c_str(), "rb");
+    if (in==NULL) return 0;
+    std::string buf(CHUNK_SIZE,0);
+    size_t len,size=0;
+    while ((len=fread(&buf[0],1,buf.size(),in))>0) fwrite(&buf[0],1,len,out),size+=len;
+    fclose(in);
+    return size;
+}
 
-class WarcFile {
-    private:
-        Reader file;
-        std::string outfile;
-        std::vector<WarcRecord> records;
-        bool doMergeSplit;
-    public:
-        WarcFile(std::string filename,std::string fileout,bool ms) : file(filename),outfile(fileout),doMergeSplit(ms) { };
-        bool ReadRecord(bool doContent=true) {
-            if (file.End()) {
-                return false;
-            }
-            std::string line="";
-            WarcRecord record;
-            line=file.ReadLine();
-            if (line=="WARC/1.0"){
-                while (line=file.ReadLine(), line.size()>0 && file.End()==false) {
-                    WarcField field;
-                    auto p=std::find(line.begin(), line.end(), ':');
-                    std::string fieldname;
-                    std::move(line.begin(), p, std::back_inserter(fieldname));
-                    int fieldID=get_warc_field_id(fieldname);
-                    if (fieldID==-1) {
-                       printf("Unexpected field %s\n", fieldname.c_str());
-                       exit(1);
-                    }
-                    field.id=fieldID;
-                    p++; // ':'
-                    std::move(p, line.end(), std::back_inserter(field.value));
-                    std::string field1=get_warc_field_name(field.id);
-                    record.fields.push_back(field);
-               }
-            } else {
-                return false;
-            }
-            int contentSize=0;
+// HTTP response head, values are views into the parsed data
+struct HttpHead {
+    std::string_view status;    // status code, empty if not an HTTP response
+    std::string_view type;      // Content-Type
+    std::string_view encoding;  // Content-Encoding
+    std::string_view transfer;  // Transfer-Encoding
+    size_t size=0;              // length with the ending CRLF CRLF, 0 if not found
+};
 
-            for(auto j=0; j <record.fields.size(); j++) {
-                if (record.fields[j].id==CONTENT_LENGTH) {
-                    contentSize=std::stoi(record.fields[j].value);
-                    break;
-                }
-            }
-            // in list mode skip content reading and seek to next entry
-            if (doContent==true) {
-                std::string content=file.ReadBlock(contentSize);
-                record.content=content;
-                if (contentSize!=content.size()) {
-                   printf("Content not same size %d %d\n", contentSize, content.size());
-                }
-            } else {
-                file.seek(contentSize);
-            }
-            records.push_back(record);
-            line=file.ReadLine();
-            if (file.LineType()!=LTYPE_CRLF) printf("Line type wrong\n");
-            line=file.ReadLine();
-            if (file.LineType()!=LTYPE_CRLF) printf("Line type wrong\n");
-            return true;
+// name equals lower case name ignoring case
+inline bool sameName(std::string_view name, std::string_view lower) {
+    if (name.size()!=lower.size()) return false;
+    for (size_t k=0; k<name.size(); k++) if (tolower((unsigned char)name[k])!=lower[k]) return false;
+    return true;
+}
+
+// Parse response head in one pass. Any status line is accepted
+// (HTTP/1.0, HTTP/1.1, HTTP/2), fields are parsed up to the empty line.
+inline HttpHead parseHttp(std::string_view data) {
+    HttpHead head;
+    if (data.substr(0,5)!="HTTP/") return head;
+    for (size_t p=0; p<data.size();) {
+        const char *e=(const char *)memchr(data.data()+p,LF,data.size()-p);
+        size_t end=e!=NULL?e-data.data():data.size();
+        std::string_view line=data.substr(p,end-p);
+        if (line.size()>0 && line.back()==CR) line.remove_suffix(1);
+        if (p==0) {
+            size_t sp=line.find(' ');
+            if (sp==std::string_view::npos || sp+4>line.size() || (sp+4<line.size() && line[sp+4]!=' ')) return head;
+            for (size_t k=sp+1; k<sp+4; k++) if (line[k]<'0' || line[k]>'9') return head;
+            head.status=line.substr(sp+1,3);
+        } else if (line.size()==0) {
+            if (e!=NULL && end>=3 && data.substr(end-3,4)=="\r\n\r\n") head.size=end+1;
+            break;
+        } else {
+            size_t c=line.find(':');
+            std::string_view name=line.substr(0,c);
+            std::string_view value=c!=std::string_view::npos?trimValue(line.substr(c+1)):std::string_view();
+            if (name.size()>0 && (name[0]|0x20)=='c') {
+                if (sameName(name,"content-type")) head.type=value;
+                else if (sameName(name,"content-encoding")) head.encoding=value;
+            } else if (sameName(name,"transfer-encoding")) head.transfer=value;
         }
+        if (e==NULL) break;
+        p=end+1;
+    }
+    return head;
+}
 
-        void EncodeWARC() {
-            FILE *out=fopen(outfile.c_str(),"wb");
-            //header
-            for(auto i=0; i <records.size(); i++) {
-                fprintf(out,"WARC/1.0\r\n");
-                for(auto j=0; j <records[i].fields.size(); j++){ 
-                    //std::string field=get_warc_field_name(records[i].fields[j].id);
-                    putc(records[i].fields[j].id,out);//fwrite(&field[0],1,field.size(),out);
-                    putc(':',out);
-                    std::string value=records[i].fields[j].value;
-                    fwrite(&value[0],1,records[i].fields[j].value.size(),out);
-                    putc(CR,out);
-                    putc(LF,out);
-                }
-                putc(CR,out);
-                putc(LF,out);
-                putc(CR,out);
-                putc(LF,out);
-            }
-            putc(CR,out);
-            putc(LF,out);
-            // content
-            for(auto i=0; i <records.size(); i++) {
-                std::string content=records[i].content;
-                if (content.size()>0) {
-                    if (doMergeSplit==false) {
-                        fwrite(&content[0],1,records[i].content.size(),out);
-                    } else {
-                        //split mode
-                        auto p=std::find(content.begin(), content.end(), '\n');
-                        std::string fieldname;
-                        std::string contentfile;
-                        std::move(content.begin(), p-1, std::back_inserter(fieldname));
-                        if (fieldname.size()>1 && (fieldname.substr(0,12)=="HTTP/1.1 200")) {
-                            auto p=std::find(content.begin(), content.end(), '\n');
-                            std::string lflf="\r\n\r\n";
-                            auto p1=std::search(content.begin(), content.end(), lflf.begin(), lflf.end());
-                            fieldname="";
-                            std::move(content.begin(), p1, std::back_inserter(fieldname));
-                            std::string header=fieldname;
-                            std::string del="\r\n";
-                            auto pos = fieldname.find(del);
-                            // Search for content type
-                            std::string ext="";
-                            while (1) {
-                                std::string linef= fieldname.substr(0, pos);
-                                std::string value;
-                                auto p=std::find(linef.begin(), linef.end(), ':');
-                                std::string fieldn="";
-                                const std::string contenttype="content-type";
-                                std::move(linef.begin(), p, std::back_inserter(fieldn));
-                                std::transform(fieldn.begin(), fieldn.end(), fieldn.begin(), [](unsigned char c){ return std::tolower(c); });
-                                int fieldID=fieldn==contenttype?1:0;
-                                p++; // ':'
-                                std::move(p, linef.end(), std::back_inserter(value));
-                                if (fieldID>0) {
-                                    std::string app=SplitString(value,'/',0);
-                                    std::string file=SplitString(value,'/',1);
-                                    ext=mimeToExt(file);
-                                    break;
-                                }
-                                if (pos==std::string::npos) break;
-                                fieldname.erase(0, pos + del.length());
-                                pos=fieldname.find(del);
-                            }
-                            //header
-                            contentfile="h"+std::to_string(i);
-                            writeContent(contentfile,header);
-                            // content after header
-                            p1++;p1++;p1++;p1++; // ':'
-                            fieldname="";
-                            std::move(p1, content.end(), std::back_inserter(fieldname));
-                            if (fieldname.size()>0){
-                                contentfile="c"+std::to_string(i)+ext;
-                                writeContent(contentfile,fieldname);
-                            }
-                        } else  if (records[i].content.size()>0) {
-                            int fid=-1;
-                            int tid=-1;
-                            std::string value="";
-                            for(auto j=0; j<records[i].fields.size(); j++) { 
-                                if (fid==-1 && records[i].fields[j].id==WARC_TYPE && records[i].fields[j].value==" resource") {
-                                    fid=records[i].fields[j].id; 
-                                } if (tid==-1 && records[i].fields[j].id==CONTENT_TYPE) {
-                                    tid=records[i].fields[j].id;
-                                    value=records[i].fields[j].value;
-                                }
-                            }
-                            std::string ext="";
-                            if (value.size()>0) {
-                                std::string app=SplitString(value,'/',0);
-                                std::string file=SplitString(value,'/',1);
-                                ext=mimeToExt(file);
-                            }
-                            contentfile=std::to_string(i)+ext;
-                            writeContent(contentfile,content);
-                        }
-                    }
-                }
+// Extension from the file type of Content-Type value ("text/html" -> ".html")
+inline std::string mimeExt(std::string_view mime) {
+    std::string ext="";
+    if (mime.size()>0) {
+        std::string value(mime);
+        std::string app=SplitString(value,'/',0);
+        std::string file=SplitString(value,'/',1);
+        ext=mimeToExt(file);
+    }
+    return ext;
+}
+
+// Extension from Content-Type of HTTP header
+inline std::string httpExt(std::string_view header) {
+    return mimeExt(parseHttp(header).type);
+}
+
+inline bool isHttp200(std::string_view content) {
+    size_t p=content.find('\n');
+    std::string_view line=content.substr(0,p!=std::string_view::npos && p>0?p-1:0);
+    return line.size()>1 && line.substr(0,12)=="HTTP/1.1 200";
+}
+
+// Opt-in statistics for --stats. Time in nested phases is counted only
+// for the inner phase, time of worker threads is summed.
+enum StatPhases {STAT_PARSE, STAT_READ, STAT_SPLIT, STAT_WRITE, STAT_PHASES};
+
+class Stats {
+    private:
+        std::chrono::steady_clock::time_point start;
+        std::atomic<int64_t> time[STAT_PHASES];
+        std::mutex lock;
+        std::map<std::string,size_t> types;
+        size_t records,bytes;
+        size_t headers[64],contents[64];   // log2 size histograms
+        void Histogram(FILE *out, const char *name, size_t *h) {
+            fprintf(out,",\"%s\":{",name);
+            for (int i=0,n=0; i<64; i++) {
+                if (h[i]>0) fprintf(out,"%s\"%zu\":%zu",n++>0?",":"",i>0?size_t(1)<<(i-1):0,h[i]);
             }
+            fprintf(out,"}");
+        }
+    public:
+        bool on;
+        Stats(): records(0),bytes(0),headers{},contents{},on(false) {
+            for (auto &t:time) t=0;
+        }
+        void Start() {
+            on=true;
+            start=std::chrono::steady_clock::now();
+        }
+        void Add(int phase, int64_t ns) { time[phase]+=ns; }
+        void Record(std::string_view type, size_t header, size_t content) {
+            if (on==false) return;
+            std::lock_guard<std::mutex> l(lock);
+            records++;
+            bytes+=header+content+4;
+            types[std::string(trimValue(type))]++;
+            auto bucket=[](size_t v) { int b=0; while (v>0) v>>=1,b++; return b; };
+            headers[bucket(header)]++;
+            contents[bucket(content)]++;
+        }
+        void Write(std::string filename, std::string_view mode, std::string_view input) {
+            double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            double s=std::max(seconds,1e-9);
+            struct rusage usage;
+            getrusage(RUSAGE_SELF,&usage);
+            FILE *out=fopen(filename.c_str(),"wb");
+            if (out==NULL) fail("Can not create %s",filename.c_str());
+            fprintf(out,"{\"mode\":%s,\"input\":%s,\"seconds\":%.6f,\"records\":%zu,\"bytes\":%zu,\"mb_per_s\":%.2f,\"records_per_s\":%.1f,\"peak_rss_kb\":%ld",
+                jsonString(mode).c_str(),jsonString(input).c_str(),seconds,records,bytes,bytes/s/1e6,records/s,usage.ru_maxrss);
+            static const char *names[STAT_PHASES]={"parse","read","split","write"};
+            fprintf(out,",\"phases\":{");
+            for (int i=0; i<STAT_PHASES; i++) fprintf(out,"%s\"%s\":%.6f",i>0?",":"",names[i],time[i]/1e9);
+            fprintf(out,"},\"types\":{");
+            int n=0;
+            for (auto &t:types) fprintf(out,"%s%s:%zu",n++>0?",":"",jsonString(t.first).c_str(),t.second);
+            fprintf(out,"}");
+            Histogram(out,"header_size",headers);
+            Histogram(out,"content_size",contents);
+            fprintf(out,"}\n");
             fclose(out);
-            file.close();
-            printf("Records: %d\n ",records.size());
         }
+};
 
-        void DecodeWrite() {
-            FILE *out=fopen(outfile.c_str(),"wb");
-            for(auto i=0; i <records.size(); i++) {
-                int contentSize=0;
-                fprintf(out,"WARC/1.0\r\n");
-                for(auto j=0; j<records[i].fields.size(); j++) {
-                    if (records[i].fields[j].id==CONTENT_LENGTH){
-                        contentSize=std::stoi(records[i].fields[j].value);
-                    }
-                    std::string field=get_warc_field_name(records[i].fields[j].id);
-                    fwrite(&field[0],1,field.size(),out);
-                    putc(':',out);
-                    std::string value=records[i].fields[j].value;
-                    fwrite(&value[0],1,records[i].fields[j].value.size(),out);
-                    putc(CR,out); putc(LF,out);
-                }
-                putc(CR,out); putc(LF,out);
-                //content
-                if (contentSize) {
-                    std::string content;
-                    if (doMergeSplit==false) {
-                        content=file.ReadBlock(contentSize);
-                    } else {
-                        std::string contentfile="h"+std::to_string(i);
-                        content=readFile(contentfile);
-                        if (content.size()>1){
-                            fwrite(&content[0],1,content.size(),out);
-                            auto p=std::find(content.begin(), content.end(), '\n');
-                            std::string fieldname;
-                            std::move(content.begin(), p-1, std::back_inserter(fieldname));
-                            if (fieldname.size()>1 && (fieldname.substr(0,12)=="HTTP/1.1 200")) {
-                                fieldname=content;
-                                std::string del="\r\n";
-                                auto pos = fieldname.find(del);
-                                std::string ext="";
-                                // Search for content type
-                                while (1) {
-                                    std::string linef= fieldname.substr(0, pos);
-                                    std::string value;
-                                    auto p=std::find(linef.begin(), linef.end(), ':');
-                                    std::string fieldn="";
-                                    const std::string contenttype="content-type";
-                                    std::move(linef.begin(), p, std::back_inserter(fieldn));
-                                    std::transform(fieldn.begin(), fieldn.end(), fieldn.begin(), [](unsigned char c){ return std::tolower(c); });
-                                    int fieldID=fieldn==contenttype?1:0;
-                                    //field.id=fieldID;
-                                    p++; // ':'
-                                    std::move(p, linef.end(), std::back_inserter(value));
-                                    if (fieldID>0) {
-                                        std::string app=SplitString(value,'/',0);
-                                        std::string file=SplitString(value,'/',1);
-                                        ext=mimeToExt(file);
-                                        break;
-                                    }
-                                    if (pos==std::string::npos) break;
-                                    fieldname.erase(0, pos + del.length());
-                                    pos=fieldname.find(del);
-                                }
-                                //header
-                                contentfile="c"+std::to_string(i)+ext;
-                                content=readFile(contentfile); 
-                                putc(CR,out); putc(LF,out);
-                                putc(CR,out); putc(LF,out);
-                                if (content.size()>0) {
-                                    fwrite(&content[0],1,content.size(),out);
-                                }
-                            }
-                        } else {
-                            int fid=-1;
-                            int tid=-1;
-                            std::string value="";
-                            for(auto j=0; j<records[i].fields.size(); j++) { 
-                                if (fid==-1 && records[i].fields[j].id==WARC_TYPE && records[i].fields[j].value==" resource") {
-                                    fid=records[i].fields[j].id; 
-                                } if (tid==-1 && records[i].fields[j].id==CONTENT_TYPE) {
-                                    tid=records[i].fields[j].id;
-                                    value=records[i].fields[j].value;
-                                }
-                            }
-                            std::string ext="";
-                            if (value.size()>0) {
-                                std::string app=SplitString(value,'/',0);
-                                std::string file=SplitString(value,'/',1);
-                                ext=mimeToExt(file);
-                            }
-                            contentfile=std::to_string(i)+ext;
-                            std::string fieldname=readFile(contentfile);
-                            if (fieldname.size()>0) fwrite(&fieldname[0],1,fieldname.size(),out);
-                        }
-                    }
-                }
-                if (file.End()) {
-                    break ;
-                }
-                putc(CR,out); putc(LF,out);
-                putc(CR,out); putc(LF,out);
-            }
+inline Stats stats;
+
+// Times a scope as phase when stats are on. An enclosing timer of the
+// same thread is paused meanwhile.
+class StatTimer {
+    private:
+        static inline thread_local int current=-1;
+        static inline thread_local std::chrono::steady_clock::time_point mark;
+        int prev;
+        void Switch(int phase) {
+            auto now=std::chrono::steady_clock::now();
+            if (current!=-1) stats.Add(current,std::chrono::duration_cast<std::chrono::nanoseconds>(now-mark).count());
+            current=phase;
+            mark=now;
+        }
+    public:
+        explicit StatTimer(int phase): prev(-2) {
+            if (stats.on) prev=current,Switch(phase);
         }
+        ~StatTimer() {
+            if (prev!=-2) Switch(prev);
+        }
+};
 
-        bool DecodeWARC() {
-            if (file.End()) {
-                return false;
+// Record content in split mode. HTTP responses are split to header and
+// content after the empty line, other content is kept whole.
+// mime is the WARC Content-Type value.
+struct SplitParts {
+    bool http=false;
+    std::string_view header;
+    std::string_view content;
+    std::string ext;
+    std::shared_ptr<std::string> data;  // normalized content
+};
+
+inline SplitParts splitParts(std::string_view content, std::string_view mime) {
+    StatTimer timer(STAT_SPLIT);
+    SplitParts parts;
+    HttpHead head=parseHttp(content);
+    parts.http=head.status.size()>0 && head.size>0;
+    if (parts.http) {
+        parts.header=content.substr(0,head.size-4);
+        parts.content=content.substr(head.size);
+        parts.ext=mimeExt(head.type);
+    } else {
+        parts.content=content;
+        parts.ext=mimeExt(mime);
+    }
+    return parts;
+}
+
+// Name of split file holding the content part
+inline std::string splitName(const SplitParts &parts, int i) {
+    return (parts.http?"c":"")+std::to_string(i)+parts.ext;
+}
+
+// Write parts of record i to split files in dir (empty or ending with '/').
+// HTTP responses are split to header file h{i} and content file c{i}{ext},
+// other content goes to {i}{ext}.
+// Content part is not written when payload is false (stored elsewhere).
+inline void splitContent(const std::string &dir, const SplitParts &parts, int i, bool payload=true) {
+    StatTimer timer(STAT_WRITE);
+    if (parts.http) writeContent(dir+"h"+std::to_string(i),parts.header);
+    if (payload && (parts.http==false || parts.content.size()>0)) writeContent(dir+splitName(parts,i),parts.content);
+}
+
+// 64 bit hash, MurmurHash64A
+inline uint64_t fastHash(std::string_view data, uint64_t seed=0) {
+    const uint64_t m=0xc6a4a7935bd1e995ULL;
+    const int r=47;
+    uint64_t h=seed^(data.size()*m);
+    size_t n=data.size()/8;
+    const char *p=data.data();
+    for (size_t i=0; i<n; i++,p+=8) {
+        uint64_t k;
+        memcpy(&k,p,8);
+        k*=m,k^=k>>r,k*=m;
+        h^=k,h*=m;
+    }
+    uint64_t t=0;
+    memcpy(&t,p,data.size()&7);
+    if (data.size()&7) h^=t,h*=m;
+    h^=h>>r,h*=m,h^=h>>r;
+    return h;
+}
+
+// Reversible payload normalization (-n). Chunked transfer coding is removed
+// and gzip/deflate content is inflated if deflate with one of the zlib levels
+// gives back the same bytes. Reconstruction data is kept in FIELD_NORMAL as
+// tokens "t:{x|X}{hex sizes}" (chunk sizes, hex digit case) and
+// "z:{g|z|r}{level}:{header hex}:{trailer hex}" (gzip, zlib or raw deflate)
+// and "h:{hex}", fastHash of the original content. Deflate output can differ
+// between zlib builds, restoring checks the hash.
+inline std::string hexString(std::string_view data) {
+    static const char digits[]="0123456789abcdef";
+    std::string s;
+    for (unsigned char c:data) s+=digits[c>>4],s+=digits[c&15];
+    return s;
+}
+
+inline std::string hexBytes(std::string_view hex) {
+    std::string s;
+    for (size_t k=0; k+1<hex.size(); k+=2) s+=char(std::stoi(std::string(hex.substr(k,2)),NULL,16));
+    return s;
+}
+
+// Body in chunked transfer coding with given chunk sizes
+inline std::string chunkBody(std::string_view data, const std::vector<size_t> &sizes, bool upper) {
+    std::string s;
+    size_t p=0;
+    char hex[32];
+    for (size_t n:sizes) {
+        snprintf(hex,sizeof(hex),upper?"%zX\r\n":"%zx\r\n",n);
+        s+=hex;
+        s.append(data.data()+p,std::min(n,data.size()-p));
+        s+="\r\n";
+        p+=n;
+    }
+    return s+"0\r\n\r\n";
+}
+
+// Chunked body to data, false if framing is not exactly as chunkBody writes it
+inline bool dechunk(std::string_view body, std::string &data, std::vector<size_t> &sizes, bool &upper) {
+    int letters=0;
+    for (size_t p=0; ; ) {
+        size_t e=body.find("\r\n",p);
+        if (e==std::string_view::npos || e==p || e-p>15) return false;
+        for (size_t k=p; k<e; k++) {
+            char c=body[k];
+            if (c>='a' && c<='f') letters|=1;
+            else if (c>='A' && c<='F') letters|=2;
+            else if (c<'0' || c>'9') return false;
+        }
+        size_t n=strtoull(std::string(body.substr(p,e-p)).c_str(),NULL,16);
+        p=e+2;
+        if (n==0) break;
+        if (n+2>body.size()-p) return false;
+        data.append(body.data()+p,n);
+        sizes.push_back(n);
+        p+=n+2;
+    }
+    upper=letters==2;
+    return letters!=3 && chunkBody(data,sizes,upper)==body;
+}
+
+// Raw deflate of data equals stream
+inline bool sameDeflate(std::string_view data, std::string_view stream, int level, int wbits) {
+    z_stream zs;
+    memset(&zs,0,sizeof(zs));
+    if (deflateInit2(&zs,level,Z_DEFLATED,-wbits,8,Z_DEFAULT_STRATEGY)!=Z_OK) return false;
+    std::string out(1<<16,0);
+    zs.next_in=(Bytef *)data.data();
+    zs.avail_in=data.size();
+    size_t pos=0;
+    int ret=Z_OK;
+    bool same=true;
+    while (same && ret==Z_OK) {
+        zs.next_out=(Bytef *)&out[0];
+        zs.avail_out=out.size();
+        ret=deflate(&zs,Z_FINISH);
+        size_t len=out.size()-zs.avail_out;
+        same=pos+len<=stream.size() && memcmp(out.data(),stream.data()+pos,len)==0;
+        pos+=len;
+    }
+    deflateEnd(&zs);
+    return same && ret==Z_STREAM_END && pos==stream.size();
+}
+
+inline std::string deflateData(std::string_view data, int level, int wbits) {
+    z_stream zs;
+    memset(&zs,0,sizeof(zs));
+    deflateInit2(&zs,level,Z_DEFLATED,-wbits,8,Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&zs,data.size()),0);
+    zs.next_in=(Bytef *)data.data();
+    zs.avail_in=data.size();
+    zs.next_out=(Bytef *)&out[0];
+    zs.avail_out=out.size();
+    deflate(&zs,Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+// Inflate raw deflate stream at the start of data, used is the stream length.
+// False if the stream is bad or inflates to more than limit bytes.
+inline bool inflateData(std::string_view data, int wbits, std::string &out, size_t &used, size_t limit) {
+    z_stream zs;
+    memset(&zs,0,sizeof(zs));
+    if (inflateInit2(&zs,-wbits)!=Z_OK) return false;
+    zs.next_in=(Bytef *)data.data();
+    zs.avail_in=data.size();
+    int ret=Z_OK;
+    while (ret==Z_OK && out.size()<=limit) {
+        size_t pos=out.size();
+        out.resize(pos+(1<<16));
+        zs.next_out=(Bytef *)&out[pos];
+        zs.avail_out=1<<16;
+        ret=inflate(&zs,Z_NO_FLUSH);
+        out.resize(pos+(1<<16)-zs.avail_out);
+        if (ret==Z_BUF_ERROR && zs.avail_in==0) break;
+    }
+    used=zs.total_in;
+    inflateEnd(&zs);
+    return ret==Z_STREAM_END && out.size()<=limit;
+}
+
+// Length of gzip member header, 0 if not gzip
+inline size_t gzipHeader(std::string_view d) {
+    if (d.size()<18 || (unsigned char)d[0]!=0x1f || (unsigned char)d[1]!=0x8b || d[2]!=8) return 0;
+    int flags=d[3];
+    size_t p=10;
+    if (flags&4) p+=2+((unsigned char)d[10]|((unsigned char)d[11]<<8));
+    for (int flag:{8,16}) {
+        if ((flags&flag)==0 || p>=d.size()) continue;
+        size_t e=d.find('\0',p);
+        if (e==std::string_view::npos) return 0;
+        p=e+1;
+    }
+    if (flags&2) p+=2;
+    return p<d.size()?p:0;
+}
+
+// Normalize content of HTTP response parts. Returns the FIELD_NORMAL value,
+// empty if content is kept as is. Normalized content is owned by parts.
+inline std::string normalizePayload(SplitParts &parts) {
+    StatTimer timer(STAT_SPLIT);
+    HttpHead head=parseHttp(parts.header);
+    std::string_view body=parts.content;
+    std::string value,data;
+    if (!parts.http || body.size()==0 || body.size()>STREAM_SIZE) return "";
+    uint64_t hash=fastHash(body);
+    if (sameName(head.transfer,"chunked")) {
+        std::vector<size_t> sizes;
+        bool upper;
+        if (!dechunk(body,data,sizes,upper)) return "";
+        value="t:"+std::string(upper?"X":"x");
+        char hex[32];
+        for (size_t k=0; k<sizes.size(); k++) snprintf(hex,sizeof(hex),k>0?",%zx":"%zx",sizes[k]),value+=hex;
+        body=data;
+    }
+    std::string_view enc=head.encoding;
+    if (sameName(enc,"gzip") || sameName(enc,"x-gzip") || sameName(enc,"deflate")) {
+        // wrapper header and trailer are kept as they are
+        char kind='g';
+        size_t hlen=gzipHeader(body),tlen=8;
+        int wbits=15;
+        if (sameName(enc,"deflate")) {
+            unsigned char cmf=body.size()>2?body[0]:0,flg=body.size()>2?body[1]:0;
+            bool zlib=(cmf&15)==8 && (cmf>>4)<=7 && (cmf*256+flg)%31==0 && (flg&32)==0;
+            kind=zlib?'z':'r',hlen=zlib?2:0,tlen=zlib?4:0;
+            if (zlib) wbits=(cmf>>4)+8;
+        }
+        std::string raw;
+        size_t used=0;
+        if ((kind!='g' || hlen>0) && inflateData(body.substr(hlen),wbits,raw,used,STREAM_SIZE) && hlen+used+tlen==body.size()) {
+            std::string_view stream=body.substr(hlen,used);
+            for (int level:{6,9,1,5,4,3,2,7,8}) {
+                if (sameDeflate(raw,stream,level,wbits)) {
+                    if (value.size()>0) value+=" ";
+                    value+="z:"+std::string(1,kind)+std::to_string(level)+(wbits!=15?"/"+std::to_string(wbits):"")+
+                        ":"+hexString(body.substr(0,hlen))+":"+hexString(body.substr(hlen+used));
+                    data=std::move(raw);
+                    break;
+                }
+            }
+        }
+    }
+    if (value.size()==0) return "";
+    char hex[24];
+    snprintf(hex,sizeof(hex)," h:%016llx",(unsigned long long)hash);
+    value+=hex;
+    parts.data=std::make_shared<std::string>(std::move(data));
+    parts.content=*parts.data;
+    return value;
+}
+
+// Original content from normalized content and FIELD_NORMAL value. Fails if
+// it does not have the hash of the original, values of earlier versions have none.
+inline std::string restorePayload(std::string_view content, std::string_view value) {
+    std::string data(content);
+    std::string chunks,hash;
+    for (size_t p=0,e; p<value.size(); p=e+1) {
+        e=std::min(value.find(' ',p),value.size());
+        std::string_view t=value.substr(p,e-p);
+        if (t.substr(0,2)=="z:") {
+            size_t c1=t.find(':',2),c2=t.find(':',c1+1);
+            std::string param(t.substr(3,c1-3));
+            int level=atoi(param.c_str());
+            int wbits=param.find('/')!=std::string::npos?atoi(param.c_str()+param.find('/')+1):15;
+            data=hexBytes(t.substr(c1+1,c2-c1-1))+deflateData(data,level,wbits)+hexBytes(t.substr(c2+1));
+        } else if (t.substr(0,2)=="t:") chunks=std::string(t.substr(2));
+        else if (t.substr(0,2)=="h:") hash=std::string(t.substr(2));
+    }
+    if (chunks.size()>0) {
+        std::vector<size_t> sizes;
+        for (size_t p=1,e; p<chunks.size(); p=e+1) {
+            e=std::min(chunks.find(',',p),chunks.size());
+            sizes.push_back(strtoull(chunks.substr(p,e-p).c_str(),NULL,16));
+        }
+        data=chunkBody(data,sizes,chunks[0]=='X');
+    }
+    if (hash.size()>0 && strtoull(hash.c_str(),NULL,16)!=fastHash(data)) fail("Normalized content not restored, deflate output differs from encoding");
+    return data;
+}
+
+// Split files of a record read back. Views point to data or to mapped packs.
+// Content files larger than STREAM_SIZE are not read, stream names the file
+// to be copied in chunks.
+struct SplitFiles {
+    std::string_view header;
+    std::string_view content;
+    std::string stream;
+    bool http;
+    std::unique_ptr<std::string> data[2];
+    SplitFiles(): http(false) { }
+    std::string_view Keep(int k, std::string &&d) {
+        data[k].reset(new std::string(std::move(d)));
+        return *data[k];
+    }
+    // Fails if required and the file is missing
+    void Load(std::string filename, bool required=false) {
+        struct stat st;
+        bool found=stat(filename.c_str(),&st)==0;
+        if (required && (found==false || access(filename.c_str(),R_OK)!=0)) fail("Can not read split file %s",filename.c_str());
+        if (found && size_t(st.st_size)>STREAM_SIZE) stream=filename;
+        else content=Keep(1,readFile(filename));
+    }
+    // Size of the content part
+    size_t Size() const {
+        struct stat st;
+        if (stream.size()>0) return stat(stream.c_str(),&st)==0?st.st_size:0;
+        return content.size();
+    }
+    void Write(FILE *out) {
+        if (stream.size()>0) copyFile(stream,out);
+        else if (content.size()>0) fwrite(content.data(),1,content.size(),out);
+    }
+};
+
+// Read back split files of record i from dir. name is the value of
+// FIELD_SPLIT_NAME, ref of FIELD_PAYLOAD_REF (file name and length) if any.
+// Without name the files are found as in es output of older versions,
+// mime is the WARC Content-Type value.
+inline SplitFiles loadSplit(const std::string &dir, std::string_view name, std::string_view mime, std::string_view ref, int i) {
+    StatTimer timer(STAT_READ);
+    SplitFiles files;
+    name=trimValue(name);
+    ref=trimValue(ref);
+    // named files must be there, except the content file of an HTTP
+    // response with empty content
+    if (name.size()>0) {
+        files.http=name[0]=='c';
+        if (files.http) {
+            std::string header=dir+"h"+std::to_string(i);
+            if (access(header.c_str(),R_OK)!=0) fail("Can not read split file %s",header.c_str());
+            files.header=files.Keep(0,readFile(header));
+        }
+        files.Load(dir+std::string(ref.size()>0?ref.substr(0,ref.rfind(' ')):name),files.http==false || ref.size()>0);
+        return files;
+    }
+    if (ref.size()>0) {
+        files.header=files.Keep(0,readFile(dir+"h"+std::to_string(i)));
+        files.http=files.header.size()>1;
+        files.Load(dir+std::string(ref.substr(0,ref.rfind(' '))),true);
+        return files;
+    }
+    files.header=files.Keep(0,readFile(dir+"h"+std::to_string(i)));
+    if (files.header.size()>1){
+        if (isHttp200(files.header)) {
+            files.Load(dir+"c"+std::to_string(i)+httpExt(files.header));
+            files.http=true;
+        }
+    } else {
+        files.Load(dir+std::to_string(i)+mimeExt(mime));
+    }
+    return files;
+}
+
+inline void putVarint(std::string &s, uint64_t v) {
+    while (v>=0x80) s+=char(v|0x80),v>>=7;
+    s+=char(v);
+}
+
+inline uint64_t getVarint(std::string_view &s) {
+    uint64_t v=0;
+    for (int shift=0; s.size()>0; shift+=7) {
+        unsigned char c=s[0];
+        s.remove_prefix(1);
+        v|=uint64_t(c&0x7f)<<shift;
+        if (c<0x80) break;
+    }
+    return v;
+}
+
+// Locations of stored payloads by WARC-Payload-Digest. A payload is a
+// duplicate only if digest, size and fast hash all match, so a wrong
+// digest in the header can not make a record restore with other content.
+class PayloadStore {
+    private:
+        struct Entry {
+            uint64_t hash;
+            size_t size;
+            std::string location;
+        };
+        std::map<std::string,Entry> entries;
+    public:
+        static const size_t MIN_SIZE=32;
+        // Location of an earlier copy or NULL. Otherwise payload is
+        // remembered at location if its digest was not seen before.
+        const std::string *Find(std::string_view digest, std::string_view payload, const std::string &location) {
+            digest=trimValue(digest);
+            if (digest.size()==0 || payload.size()<MIN_SIZE) return NULL;
+            uint64_t hash=fastHash(payload);
+            auto it=entries.find(std::string(digest));
+            if (it!=entries.end()) {
+                if (it->second.hash==hash && it->second.size==payload.size()) return &it->second.location;
+                return NULL;
+            }
+            entries[std::string(digest)]=Entry{hash,payload.size(),location};
+            return NULL;
+        }
+};
+
+enum PackKinds {
+    PACK_HEADER,PACK_CONTENT,PACK_OTHER
+};
+
+// Split mode output in pack files instead of one file per part. HTTP headers
+// go to name.hdr.pack, content to name.pack{ext} so that content of one type
+// is stored together. name.ptab lists record, kind, pack and length of each
+// part in record order, offsets follow from the order in each pack.
+class PackWriter {
+    private:
+        std::string name;
+        std::map<std::string,int> ids;
+        std::vector<FILE *> packs;
+        std::vector<size_t> sizes;
+        std::vector<std::string> groups;
+        std::string table;
+        int last;
+        int Pack(int kind, std::string group) {
+            auto it=ids.find(group);
+            int id;
+            if (it==ids.end()) {
+                id=packs.size();
+                ids[group]=id;
+                groups.push_back(group);
+                std::string file=kind==PACK_HEADER?name+".hdr.pack":name+".pack"+group;
+                FILE *f=fopen(file.c_str(),"wb");
+                if (f==NULL) fail("Can not create %s",file.c_str());
+                packs.push_back(f);
+                sizes.push_back(0);
+            } else id=it->second;
+            return id;
+        }
+        void Add(int i, int kind, std::string group, std::string_view data) {
+            fwrite(data.data(),1,data.size(),Open(i,kind,group,data.size()));
+        }
+    public:
+        explicit PackWriter(std::string fileout): name(fileout),last(0) { }
+        // Add part of size bytes, the caller writes them to the returned pack
+        FILE *Open(int i, int kind, std::string group, size_t size) {
+            int id=Pack(kind,group);
+            putVarint(table,i-last);
+            putVarint(table,kind);
+            putVarint(table,id);
+            putVarint(table,size);
+            last=i;
+            sizes[id]+=size;
+            return packs[id];
+        }
+        // Content part is not written when payload is false (stored elsewhere)
+        void Write(const SplitParts &parts, int i, bool payload=true) {
+            StatTimer timer(STAT_WRITE);
+            if (parts.http) {
+                // header group name can not clash with an extension
+                Add(i,PACK_HEADER,"/",parts.header);
+                if (payload && parts.content.size()>0) Add(i,PACK_CONTENT,parts.ext,parts.content);
+            } else if (payload) {
+                Add(i,PACK_OTHER,parts.ext,parts.content);
+            }
+        }
+        // Pack and offset where the content part of parts is written next
+        std::string Location(const SplitParts &parts) {
+            int id=Pack(parts.http?PACK_CONTENT:PACK_OTHER,parts.ext);
+            return std::to_string(id)+" "+std::to_string(sizes[id]);
+        }
+        void Close() {
+            for (auto f:packs) fclose(f);
+            std::string head="WPK1";
+            putVarint(head,groups.size());
+            for (auto &g:groups) {
+                putVarint(head,g.size());
+                head+=g;
+            }
+            std::string file=name+".ptab";
+            FILE *out=fopen(file.c_str(),"wb");
+            fwrite(head.data(),1,head.size(),out);
+            fwrite(table.data(),1,table.size(),out);
+            fclose(out);
+        }
+};
+
+// Reads parts of records in order from pack files of PackWriter.
+// Packs are mapped, parts are returned as views.
+class PackReader {
+    private:
+        std::string tabledata;
+        std::string_view table;
+        std::vector<std::unique_ptr<Reader>> packs;
+        int next;
+        int kind,pack;
+        size_t size;
+        bool Entry() {
+            if (table.size()==0) return false;
+            next+=getVarint(table);
+            kind=getVarint(table);
+            pack=getVarint(table);
+            size=getVarint(table);
+            return true;
+        }
+    public:
+        explicit PackReader(std::string filein): next(0) {
+            tabledata=readFile(filein+".ptab");
+            table=tabledata;
+            if (table.substr(0,4)!="WPK1") fail("Pack table %s.ptab not found",filein.c_str());
+            table.remove_prefix(4);
+            int n=getVarint(table);
+            for (int i=0; i<n; i++) {
+                size_t len=getVarint(table);
+                std::string group(table.substr(0,len));
+                table.remove_prefix(len);
+                std::string file=group=="/"?filein+".hdr.pack":filein+".pack"+group;
+                packs.emplace_back(new Reader(file,1,false));
+                packs.back()->Keep(CHUNK_SIZE);
+            }
+            if (!Entry()) next=-1;
+        }
+        // Parts of record i, views are valid until next call. ref is the
+        // value of FIELD_PAYLOAD_REF (pack, offset and length) if any.
+        SplitFiles Load(int i, std::string_view ref) {
+            StatTimer timer(STAT_READ);
+            SplitFiles files;
+            while (next==i) {
+                std::string_view data=packs[pack]->ReadBlock(size);
+                if (kind==PACK_HEADER) files.header=data,files.http=true;
+                else files.content=data;
+                if (!Entry()) next=-1;
+            }
+            if (ref.size()>0) {
+                std::string loc(trimValue(ref));
+                size_t id=0,off=0,len=0;
+                sscanf(loc.c_str(),"%zu %zu %zu",&id,&off,&len);
+                if (id<packs.size()) files.content=packs[id]->ReadAt(off,len);
+            }
+            return files;
+        }
+        void Close() {
+            for (auto &p:packs) p->close();
+        }
+};
+
+// Deterministic random numbers for the generator (splitmix64)
+struct SplitMix {
+    uint64_t s;
+    SplitMix(uint64_t seed): s(seed) {}
+    uint64_t Next() {
+        uint64_t z=(s+=0x9e3779b97f4a7c15ULL);
+        z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z=(z^(z>>27))*0x94d049bb133111ebULL;
+        return z^(z>>31);
+    }
+    uint64_t Below(uint64_t n) { return n>0?Next()%n:0; }
+    bool Percent(int p) { return int(Below(100))<p; }
+};
+
+inline std::string base32(std::string_view data) {
+    static const char digits[]="ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+    std::string s;
+    uint32_t bits=0;
+    int n=0;
+    for (unsigned char c:data) {
+        bits=(bits<<8)|c, n+=8;
+        while (n>=5) s+=digits[(bits>>(n-5))&31], n-=5;
+    }
+    if (n>0) s+=digits[(bits<<(5-n))&31];
+    return s;
+}
+
+static const uint32_t SHA256_K[64]={
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2};
+
+#if defined(__x86_64__) || defined(__i386__)
+// SHA-1 and SHA-256 of whole 64 byte blocks with the x86 SHA extensions
+static bool hasShaNi() {
+    unsigned a,b,c,d;
+    if (__get_cpuid(1,&a,&b,&c,&d)==0 || (c&(1<<19))==0 || (c&(1<<9))==0) return false;
+    return __get_cpuid_count(7,0,&a,&b,&c,&d)!=0 && (b&(1<<29))!=0;
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1Blocks(uint32_t h[5], const unsigned char *p, size_t n) {
+    const __m128i MASK=_mm_set_epi64x(0x0001020304050607ULL,0x08090a0b0c0d0e0fULL);
+    __m128i abcd=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h),0x1b);
+    __m128i e0=_mm_set_epi32(h[4],0,0,0),e1;
+    for (; n>0; n--,p+=64) {
+        __m128i abcdSave=abcd,e0Save=e0;
+        __m128i m[4]={_mm_setzero_si128(),_mm_setzero_si128(),_mm_setzero_si128(),_mm_setzero_si128()};
+        // 4 rounds of group g, message schedule of later groups
+        #define SHA1_GROUP(g,f) { \
+            if (g<4) m[g%4]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+16*(g%4))),MASK); \
+            __m128i &ec=(g&1)?e1:e0,&eo=(g&1)?e0:e1; \
+            ec=g==0?_mm_add_epi32(ec,m[0]):_mm_sha1nexte_epu32(ec,m[g%4]); \
+            eo=abcd; \
+            if (g>=3) m[(g+1)%4]=_mm_sha1msg2_epu32(m[(g+1)%4],m[g%4]); \
+            abcd=_mm_sha1rnds4_epu32(abcd,ec,f); \
+            if (g>=1) m[(g+3)%4]=_mm_sha1msg1_epu32(m[(g+3)%4],m[g%4]); \
+            if (g>=2) m[(g+2)%4]=_mm_xor_si128(m[(g+2)%4],m[g%4]); }
+        SHA1_GROUP(0,0) SHA1_GROUP(1,0) SHA1_GROUP(2,0) SHA1_GROUP(3,0) SHA1_GROUP(4,0)
+        SHA1_GROUP(5,1) SHA1_GROUP(6,1) SHA1_GROUP(7,1) SHA1_GROUP(8,1) SHA1_GROUP(9,1)
+        SHA1_GROUP(10,2) SHA1_GROUP(11,2) SHA1_GROUP(12,2) SHA1_GROUP(13,2) SHA1_GROUP(14,2)
+        SHA1_GROUP(15,3) SHA1_GROUP(16,3) SHA1_GROUP(17,3) SHA1_GROUP(18,3) SHA1_GROUP(19,3)
+        #undef SHA1_GROUP
+        e0=_mm_sha1nexte_epu32(e0,e0Save);
+        abcd=_mm_add_epi32(abcd,abcdSave);
+    }
+    _mm_storeu_si128((__m128i *)h,_mm_shuffle_epi32(abcd,0x1b));
+    h[4]=_mm_extract_epi32(e0,3);
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256Blocks(uint32_t h[8], const unsigned char *p, size_t n, const uint32_t K[64]) {
+    const __m128i MASK=_mm_set_epi64x(0x0c0d0e0f08090a0bULL,0x0405060700010203ULL);
+    __m128i t=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h),0xb1);
+    __m128i s1=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h+4)),0x1b);
+    __m128i s0=_mm_alignr_epi8(t,s1,8);     // ABEF
+    s1=_mm_blend_epi16(s1,t,0xf0);          // CDGH
+    for (; n>0; n--,p+=64) {
+        __m128i s0Save=s0,s1Save=s1,m[4];
+        #pragma GCC unroll 16
+        for (int g=0; g<16; g++) {
+            if (g<4) m[g]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p+16*g)),MASK);
+            __m128i msg=_mm_add_epi32(m[g%4],_mm_loadu_si128((const __m128i *)(K+4*g)));
+            s1=_mm_sha256rnds2_epu32(s1,s0,msg);
+            if (g>=3 && g<15) {
+                m[(g+1)%4]=_mm_add_epi32(m[(g+1)%4],_mm_alignr_epi8(m[g%4],m[(g+3)%4],4));
+                m[(g+1)%4]=_mm_sha256msg2_epu32(m[(g+1)%4],m[g%4]);
+            }
+            s0=_mm_sha256rnds2_epu32(s0,s1,_mm_shuffle_epi32(msg,0x0e));
+            if (g>=1 && g<13) m[(g+3)%4]=_mm_sha256msg1_epu32(m[(g+3)%4],m[g%4]);
+        }
+        s0=_mm_add_epi32(s0,s0Save);
+        s1=_mm_add_epi32(s1,s1Save);
+    }
+    t=_mm_shuffle_epi32(s0,0x1b);           // FEBA
+    s1=_mm_shuffle_epi32(s1,0xb1);          // DCHG
+    _mm_storeu_si128((__m128i *)h,_mm_blend_epi16(t,s1,0xf0));
+    _mm_storeu_si128((__m128i *)(h+4),_mm_alignr_epi8(s1,t,8));
+}
+#endif
+
+// SHA-1 and SHA-256 (FIPS 180-4) for WARC digests. Data is added with
+// Update, Final returns the raw digest. Blocks are hashed with the SHA
+// instructions when the CPU has them.
+class Sha {
+    private:
+        bool sha256;
+        uint32_t h[8];
+        unsigned char buf[64];
+        size_t len;
+        uint64_t total;
+        static uint32_t Rol(uint32_t x, int n) { return (x<<n)|(x>>(32-n)); }
+        static uint32_t Ror(uint32_t x, int n) { return (x>>n)|(x<<(32-n)); }
+        void Block(const unsigned char *p) {
+            uint32_t w[80];
+            for (int t=0; t<16; t++) w[t]=uint32_t(p[t*4])<<24|uint32_t(p[t*4+1])<<16|uint32_t(p[t*4+2])<<8|p[t*4+3];
+            uint32_t a=h[0],b=h[1],c=h[2],d=h[3],e=h[4];
+            if (sha256==false) {
+                for (int t=16; t<80; t++) w[t]=Rol(w[t-3]^w[t-8]^w[t-14]^w[t-16],1);
+                #define SHA1_ROUND(f,k) { uint32_t x=Rol(a,5)+(f)+e+k+w[t]; e=d,d=c,c=Rol(b,30),b=a,a=x; }
+                int t=0;
+                for (; t<20; t++) SHA1_ROUND(d^(b&(c^d)),0x5a827999);
+                for (; t<40; t++) SHA1_ROUND(b^c^d,0x6ed9eba1);
+                for (; t<60; t++) SHA1_ROUND((b&c)|(d&(b|c)),0x8f1bbcdc);
+                for (; t<80; t++) SHA1_ROUND(b^c^d,0xca62c1d6);
+                #undef SHA1_ROUND
+                h[0]+=a,h[1]+=b,h[2]+=c,h[3]+=d,h[4]+=e;
+                return;
+            }
+            for (int t=16; t<64; t++) {
+                uint32_t s0=Ror(w[t-15],7)^Ror(w[t-15],18)^(w[t-15]>>3);
+                uint32_t s1=Ror(w[t-2],17)^Ror(w[t-2],19)^(w[t-2]>>10);
+                w[t]=w[t-16]+s0+w[t-7]+s1;
+            }
+            uint32_t f=h[5],g=h[6],k=h[7];
+            for (int t=0; t<64; t++) {
+                uint32_t x=k+(Ror(e,6)^Ror(e,11)^Ror(e,25))+((e&f)^(~e&g))+SHA256_K[t]+w[t];
+                uint32_t y=(Ror(a,2)^Ror(a,13)^Ror(a,22))+((a&b)^(a&c)^(b&c));
+                k=g,g=f,f=e,e=d+x,d=c,c=b,b=a,a=x+y;
+            }
+            h[0]+=a,h[1]+=b,h[2]+=c,h[3]+=d,h[4]+=e,h[5]+=f,h[6]+=g,h[7]+=k;
+        }
+        void Blocks(const unsigned char *p, size_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+            static const bool hw=hasShaNi();
+            if (hw && sha256) return sha256Blocks(h,p,n,SHA256_K);
+            if (hw) return sha1Blocks(h,p,n);
+#endif
+            for (; n>0; n--,p+=64) Block(p);
+        }
+    public:
+        explicit Sha(bool is256=false): sha256(is256),len(0),total(0) {
+            static const uint32_t H1[5]={0x67452301,0xefcdab89,0x98badcfe,0x10325476,0xc3d2e1f0};
+            static const uint32_t H256[8]={0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+            if (sha256) memcpy(h,H256,sizeof(H256));
+            else memcpy(h,H1,sizeof(H1));
+        }
+        void Update(std::string_view data) {
+            const unsigned char *p=(const unsigned char *)data.data();
+            size_t n=data.size();
+            total+=n;
+            if (len>0) {
+                size_t k=std::min(n,64-len);
+                memcpy(buf+len,p,k);
+                len+=k,p+=k,n-=k;
+                if (len<64) return;
+                Blocks(buf,1),len=0;
+            }
+            Blocks(p,n/64);
+            p+=n&~size_t(63),n&=63;
+            memcpy(buf,p,n),len=n;
+        }
+        std::string Final() {
+            uint64_t bits=total*8;
+            unsigned char pad[72]={0x80};
+            size_t n=(len<56?56:120)-len;
+            for (int k=0; k<8; k++) pad[n+k]=bits>>(56-8*k);
+            Update(std::string_view((const char *)pad,n+8));
+            std::string s(sha256?32:20,0);
+            for (size_t k=0; k<s.size(); k++) s[k]=h[k/4]>>(24-8*(k%4));
+            return s;
+        }
+};
+
+// Digest algorithm of a WARC digest value ("sha1:..." or "sha256:..."),
+// 1 or 256, 0 if not known
+inline int digestType(std::string_view value) {
+    value=trimValue(value);
+    std::string label;
+    for (char c:value.substr(0,value.find(':'))) if (c!='-') label+=tolower((unsigned char)c);
+    return label=="sha1"?1:label=="sha256"?256:0;
+}
+
+// Digest encoded as the expected value (base32 or hex with its label),
+// empty if it does not match
+inline std::string digestMatch(std::string_view expected, const std::string &digest, bool &same) {
+    expected=trimValue(expected);
+    size_t c=expected.find(':');
+    std::string_view label=expected.substr(0,c),value=expected.substr(c+1);
+    while (value.size()>0 && value.back()=='=') value.remove_suffix(1);
+    std::string s=value.size()==digest.size()*2?hexString(digest):base32(digest);
+    same=s.size()==value.size();
+    for (size_t k=0; same && k<s.size(); k++) same=tolower((unsigned char)s[k])==tolower((unsigned char)value[k]);
+    return std::string(label)+":"+s;
+}
+
+// Block and payload digests of one record. Content is added in order with
+// Update, in one piece or in chunks. For application/http records the
+// payload starts after the HTTP head, which has to be in the first piece.
+struct RecordDigest {
+    int i;
+    size_t offset;
+    std::string id;
+    std::string block;      // expected values, empty if none
+    std::string payload;
+    int state;              // 0 before payload, 1 in payload, 2 HTTP head not found
+    Sha blockHash;
+    Sha payloadHash;
+    RecordDigest(std::string_view b, std::string_view p, bool http): block(b),payload(p),state(http?0:1),blockHash(digestType(b)==256),payloadHash(digestType(p)==256) { }
+    void Update(std::string_view data) {
+        if (data.size()==0) return;
+        if (block.size()>0) blockHash.Update(data);
+        if (payload.size()==0 || state==2) return;
+        if (state==0) {
+            size_t p=data.find("\r\n\r\n");
+            state=p!=std::string_view::npos?1:2;
+            if (state==2) return;
+            data.remove_prefix(p+4);
+        }
+        payloadHash.Update(data);
+    }
+};
+
+// Digest check of the records of a file. Records are finished in any order,
+// mismatches are reported in record order.
+class DigestCheck {
+    private:
+        std::mutex lock;
+        std::map<int,std::string> lines;
+        std::atomic<size_t> checked,failed,unknown;
+        void Compare(RecordDigest &r, const char *field, const std::string &expected, Sha &hash) {
+            if (expected.size()==0) return;
+            bool same;
+            std::string value=digestMatch(expected,hash.Final(),same);
+            checked++;
+            if (same) return;
+            failed++;
+            std::string line=std::to_string(r.offset)+"\t"+r.id+"\t"+field+"\t"+std::string(trimValue(expected))+"\t"+value+"\n";
+            std::lock_guard<std::mutex> l(lock);
+            lines[r.i]+=line;
+        }
+    public:
+        DigestCheck(): checked(0),failed(0),unknown(0) { }
+        // Digests to compute for record i, nullptr if it has no known digest
+        std::shared_ptr<RecordDigest> Start(const WarcRecord &record, int i) {
+            int j=record.Find(WARC_BLOCK_DIGEST),k=record.Find(WARC_PAYLOAD_DIGEST);
+            std::string_view block=j!=-1?record.Value(j):std::string_view();
+            std::string_view payload=k!=-1?record.Value(k):std::string_view();
+            if (block.size()>0 && digestType(block)==0) unknown++,block=std::string_view();
+            if (payload.size()>0 && digestType(payload)==0) unknown++,payload=std::string_view();
+            if (block.size()==0 && payload.size()==0) return nullptr;
+            int t=record.Find(CONTENT_TYPE),id=record.Find(WARC_RECORD_ID);
+            auto r=std::make_shared<RecordDigest>(block,payload,t!=-1 && trimValue(record.Value(t)).substr(0,16)=="application/http");
+            r->i=i;
+            r->offset=record.offset;
+            r->id=id!=-1?std::string(trimValue(record.Value(id))):"-";
+            return r;
+        }
+        void Finish(RecordDigest &r) {
+            Compare(r,"WARC-Block-Digest",r.block,r.blockHash);
+            if (r.payload.size()>0 && r.state!=1) unknown++;
+            else Compare(r,"WARC-Payload-Digest",r.payload,r.payloadHash);
+        }
+        // Write mismatches (offset, record id, field, expected and computed value)
+        // and a summary line. Returns number of mismatches.
+        size_t Write(std::string filename) {
+            FILE *out=filename=="-"?stdout:fopen(filename.c_str(),"wb");
+            if (out==NULL) fail("Can not create %s",filename.c_str());
+            for (auto &l:lines) fwrite(l.second.data(),1,l.second.size(),out);
+            fprintf(out,"# digests checked %zu, mismatched %zu, not checked %zu\n",size_t(checked),size_t(failed),size_t(unknown));
+            if (out!=stdout) fclose(out);
+            return failed;
+        }
+};
+
+// Synthetic WARC spec for mode g, a comma list of key=value:
+// n records, seed, max content size (sizes are log-uniform up to max),
+// http percent of HTTP captures (request+response), err percent of non 200
+// responses, dup percent of repeated payloads, fields 0-2 for minimal,
+// common or all optional fields, mime list separated by ':'.
+struct GenSpec {
+    int records=1000;
+    uint64_t seed=1;
+    size_t max=1<<16;
+    int http=80;
+    int err=10;
+    int dup=10;
+    int fields=1;
+    std::vector<std::string> mimes={"text/html","text/plain","text/css","application/javascript","image/jpeg","image/png","application/pdf"};
+};
+
+inline GenSpec parseGenSpec(std::string spec) {
+    GenSpec g;
+    size_t p=0;
+    while (p<spec.size()) {
+        size_t e=spec.find(',',p);
+        if (e==std::string::npos) e=spec.size();
+        std::string item=spec.substr(p,e-p);
+        std::string key=SplitString(item,'=',0),value=SplitString(item,'=',1);
+        if (key=="n") g.records=atoi(value.c_str());
+        else if (key=="seed") g.seed=strtoull(value.c_str(),NULL,10);
+        else if (key=="max") g.max=std::max(1ULL,strtoull(value.c_str(),NULL,10));
+        else if (key=="http") g.http=atoi(value.c_str());
+        else if (key=="err") g.err=atoi(value.c_str());
+        else if (key=="dup") g.dup=atoi(value.c_str());
+        else if (key=="fields") g.fields=atoi(value.c_str());
+        else if (key=="mime") {
+            g.mimes.clear();
+            for (size_t q=0,r; q<=value.size(); q=r+1) {
+                r=std::min(value.find(':',q),value.size());
+                if (r>q) g.mimes.push_back(value.substr(q,r-q));
+            }
+            if (g.mimes.size()==0) g.mimes.push_back("application/octet-stream");
+        } else if (item.size()>0) {
+            fail("Unknown generator option %s",item.c_str());
+        }
+        p=e+1;
+    }
+    return g;
+}
+
+class WarcGenerator {
+    private:
+        GenSpec spec;
+        SplitMix rng;
+        FILE *out;
+        std::string warcinfo;
+        std::vector<std::pair<std::string,std::string>> payloads; // mime, payload for dup
+        long date;
+        int count;
+        std::string Uuid() {
+            uint64_t a=rng.Next(),b=rng.Next();
+            char s[64];
+            snprintf(s,sizeof(s),"<urn:uuid:%08x-%04x-4%03x-8%03x-%012llx>",unsigned(a>>32),unsigned(a>>16)&0xffff,
+                unsigned(a)&0xfff,unsigned(b>>48)&0xfff,(unsigned long long)b&0xffffffffffffULL);
+            return s;
+        }
+        std::string Date() {
+            time_t t=date;
+            struct tm tm;
+            char s[32];
+            gmtime_r(&t,&tm);
+            strftime(s,sizeof(s),"%Y-%m-%dT%H:%M:%SZ",&tm);
+            return s;
+        }
+        std::string Digest(std::string_view data) {
+            Sha sha;
+            sha.Update(data);
+            return "sha1:"+base32(sha.Final());
+        }
+        // Content size, log-uniform in 1..max
+        size_t Size() {
+            int bits=0;
+            while ((size_t(2)<<bits)<=spec.max) bits++;
+            int k=rng.Below(bits+1);
+            size_t lo=size_t(1)<<k;
+            size_t hi=std::min(spec.max,(lo<<1)-1);
+            return lo+rng.Below(hi-lo+1);
+        }
+        std::string Payload(std::string_view mime, size_t size) {
+            static const char *words[]={"the","archive","web","record","of","and","page","content","to","in","crawl","data"};
+            std::string s;
+            s.reserve(size+16);
+            if (mime.substr(0,5)=="text/" || mime.find("javascript")!=std::string_view::npos) {
+                while (s.size()<size) {
+                    s+=words[rng.Below(12)];
+                    s+=rng.Percent(8)?'\n':' ';
+                }
+                s.resize(size);
+            } else {
+                while (s.size()<size) {
+                    uint64_t v=rng.Next();
+                    s.append((const char *)&v,std::min(size_t(8),size-s.size()));
+                }
+            }
+            return s;
+        }
+        void Record(std::vector<std::pair<int,std::string>> &fields, std::string_view content) {
+            fprintf(out,"WARC/1.0\r\n");
+            count++;
+            for (auto &f:fields) {
+                std::string_view name=get_warc_field_name(f.first);
+                fprintf(out,"%.*s: %s\r\n",int(name.size()),name.data(),f.second.c_str());
+            }
+            fprintf(out,"Content-Length: %zu\r\n\r\n",content.size());
+            fwrite(content.data(),1,content.size(),out);
+            fprintf(out,"\r\n\r\n");
+        }
+        void Capture(int i) {
+            std::string mime=spec.mimes[rng.Below(spec.mimes.size())];
+            std::string payload;
+            if (payloads.size()>0 && rng.Percent(spec.dup)) {
+                auto &p=payloads[rng.Below(payloads.size())];
+                mime=p.first, payload=p.second;
+            } else {
+                payload=Payload(mime,Size());
+                if (payloads.size()<64) payloads.push_back({mime,payload});
+                else payloads[rng.Below(64)]={mime,payload};
+            }
+            std::string ext=mimeExt(mime);
+            std::string host="www.example"+std::to_string(rng.Below(50))+".com";
+            std::string uri=std::string(rng.Percent(50)?"https":"http")+"://"+host+"/p"+std::to_string(rng.Below(1000))+"/"+std::to_string(i)+(ext.size()>0?ext:".bin");
+            std::string ip="10."+std::to_string(rng.Below(256))+"."+std::to_string(rng.Below(256))+"."+std::to_string(rng.Below(256));
+            date+=1+rng.Below(10);
+            std::string id=Uuid();
+            std::vector<std::pair<int,std::string>> f;
+            if (rng.Percent(spec.http)) {
+                // response and request
+                std::string status="200 OK",location;
+                if (rng.Percent(spec.err)) {
+                    if (rng.Percent(50)) status="404 Not Found",mime="text/html",payload="<html><body>Not Found</body></html>\n";
+                    else status="301 Moved Permanently",location="Location: "+uri+"/\r\n",payload="";
+                }
+                std::string http="HTTP/1.1 "+status+"\r\nDate: "+Date()+"\r\n"+location+"Content-Type: "+mime+"\r\nContent-Length: "+std::to_string(payload.size())+"\r\n\r\n";
+                std::string content=http+payload;
+                std::string reqid=Uuid();
+                f.push_back({WARC_TYPE,"response"});
+                f.push_back({WARC_RECORD_ID,id});
+                if (spec.fields>0) f.push_back({WARC_WARCINFO_ID,warcinfo});
+                if (spec.fields>0) f.push_back({WARC_CONCURRENT_TO,reqid});
+                f.push_back({WARC_TARGET_URI,uri});
+                f.push_back({WARC_DATE,Date()});
+                if (spec.fields>0) f.push_back({WARC_IP_ADDRESS,ip});
+                if (spec.fields>1) f.push_back({WARC_PROTOCOL,"http/1.1"});
+                if (spec.fields>0) f.push_back({WARC_BLOCK_DIGEST,Digest(content)});
+                if (spec.fields>0) f.push_back({WARC_PAYLOAD_DIGEST,Digest(payload)});
+                if (spec.fields>1) f.push_back({WARC_IDENTIFIED_PAYLOAD_TYPE,mime});
+                f.push_back({CONTENT_TYPE,"application/http;msgtype=response"});
+                Record(f,content);
+                std::string request="GET "+uri.substr(uri.find('/',8))+" HTTP/1.1\r\nHost: "+host+"\r\nUser-Agent: warc_f\r\nAccept: */*\r\n\r\n";
+                f.clear();
+                f.push_back({WARC_TYPE,"request"});
+                f.push_back({WARC_RECORD_ID,reqid});
+                if (spec.fields>0) f.push_back({WARC_WARCINFO_ID,warcinfo});
+                if (spec.fields>0) f.push_back({WARC_CONCURRENT_TO,id});
+                f.push_back({WARC_TARGET_URI,uri});
+                f.push_back({WARC_DATE,Date()});
+                if (spec.fields>0) f.push_back({WARC_BLOCK_DIGEST,Digest(request)});
+                f.push_back({CONTENT_TYPE,"application/http;msgtype=request"});
+                Record(f,request);
+            } else {
+                f.push_back({WARC_TYPE,"resource"});
+                f.push_back({WARC_RECORD_ID,id});
+                if (spec.fields>0) f.push_back({WARC_WARCINFO_ID,warcinfo});
+                f.push_back({WARC_TARGET_URI,uri});
+                f.push_back({WARC_DATE,Date()});
+                if (spec.fields>0) f.push_back({WARC_BLOCK_DIGEST,Digest(payload)});
+                if (spec.fields>0) f.push_back({WARC_PAYLOAD_DIGEST,Digest(payload)});
+                f.push_back({CONTENT_TYPE,mime});
+                Record(f,payload);
+                if (spec.fields>1) {
+                    std::string meta="via: "+uri+"\r\nfetchTimeMs: "+std::to_string(rng.Below(2000))+"\r\n";
+                    f.clear();
+                    f.push_back({WARC_TYPE,"metadata"});
+                    f.push_back({WARC_RECORD_ID,Uuid()});
+                    f.push_back({WARC_WARCINFO_ID,warcinfo});
+                    f.push_back({WARC_REFERS_TO,id});
+                    f.push_back({WARC_TARGET_URI,uri});
+                    f.push_back({WARC_DATE,Date()});
+                    f.push_back({CONTENT_TYPE,"application/warc-fields"});
+                    Record(f,meta);
+                }
+            }
+        }
+    public:
+        WarcGenerator(const GenSpec &g): spec(g),rng(g.seed),out(NULL),date(1735689600),count(0) {}
+        // Same spec gives the same file
+        void Write(std::string filename) {
+            out=fopen(filename.c_str(),"wb");
+            if (out==NULL) fail("Can not create %s",filename.c_str());
+            warcinfo=Uuid();
+            std::string info="software: warc_f\r\nformat: WARC File Format 1.0\r\nseed: "+std::to_string(spec.seed)+"\r\n";
+            std::vector<std::pair<int,std::string>> f={{WARC_TYPE,"warcinfo"},{WARC_RECORD_ID,warcinfo},{WARC_DATE,Date()}};
+            if (spec.fields>1) f.push_back({WARC_FILENAME,filename.substr(filename.rfind('/')+1)});
+            f.push_back({CONTENT_TYPE,"application/warc-fields"});
+            Record(f,info);
+            for (int i=0; i<spec.records; i++) Capture(i);
+            fclose(out);
+            printf("Records: %d\n ",count);
+        }
+};
+
+// Header section of encoded files (e, es). It starts with a dictionary:
+//   warc_f/2 rows|columns [pack]
+//   field names ranked by count, one per line, the k-th has id lineId(k)
+//   empty line
+// Records follow as rows (version line, id:value lines, two empty lines)
+// or in column blocks (see ColumnWriter), the section ends with an empty line.
+// Input without the dictionary (earlier versions) is rows with WARC_FIELDS ids.
+static const std::string_view ENCODED_MAGIC="warc_f/2";
+// Back-references of column blocks reach this many records and all warcinfo records
+static const uint64_t RECENT_IDS=1<<16;
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar and back
+inline int64_t civilDays(int64_t y, int m, int d) {
+    y-=m<=2;
+    int64_t era=(y>=0?y:y-399)/400;
+    int yoe=int(y-era*400);
+    int doy=(153*(m>2?m-3:m+9)+2)/5+d-1;
+    return era*146097+yoe*365+yoe/4-yoe/100+doy-719468;
+}
+inline void civilDate(int64_t z, int64_t &y, int &m, int &d) {
+    z+=719468;
+    int64_t era=(z>=0?z:z-146096)/146097;
+    int doe=int(z-era*146097);
+    int yoe=(doe-doe/1460+doe/36524-doe/146096)/365;
+    int doy=doe-(365*yoe+yoe/4-yoe/100);
+    int mp=(5*doy+2)/153;
+    d=doy-(153*mp+2)/5+1;
+    m=mp<10?mp+3:mp-9;
+    y=yoe+era*400+(m<=2);
+}
+
+// WARC-Date value " YYYY-MM-DDThh:mm:ssZ" of seconds since 1970
+inline std::string warcDate(int64_t t) {
+    int64_t days=(t>=0?t:t-86399)/86400,s=t-days*86400,y;
+    int m,d;
+    civilDate(days,y,m,d);
+    char v[64];
+    snprintf(v,sizeof(v)," %04lld-%02d-%02dT%02d:%02d:%02dZ",(long long)y,m,d,int(s/3600),int(s/60%60),int(s%60));
+    return v;
+}
+// Seconds of a WARC-Date value, false for values warcDate does not give
+// back the same (fractions of a second, other spacing)
+inline bool warcSeconds(std::string_view value, int64_t &t) {
+    static const char form[]=" 0000-00-00T00:00:00Z";
+    if (value.size()!=21) return false;
+    int v[6]={},k=0;
+    for (size_t p=0; p<21; p++) {
+        if (form[p]!='0') {
+            if (value[p]!=form[p]) return false;
+            k+=p>1;
+        } else if (value[p]>='0' && value[p]<='9') v[k]=v[k]*10+value[p]-'0';
+        else return false;
+    }
+    if (v[1]<1 || v[1]>12 || v[2]<1 || v[2]>31 || v[3]>23 || v[4]>59 || v[5]>59) return false;
+    int64_t days=civilDays(v[0],v[1],v[2]),y;
+    int m,d;
+    civilDate(days,y,m,d);
+    if (m!=v[1] || d!=v[2]) return false;
+    t=days*86400+v[3]*3600+v[4]*60+v[5];
+    return true;
+}
+
+// Content-Length " N" without leading zeros, false for other forms
+inline bool lengthValue(std::string_view value, uint64_t &n) {
+    if (value.size()<2 || value.size()>19 || value[0]!=' ' || (value[1]=='0' && value.size()>2)) return false;
+    n=0;
+    for (char c:value.substr(1)) {
+        if (c<'0' || c>'9') return false;
+        n=n*10+c-'0';
+    }
+    return true;
+}
+
+// Value of a Content-Length field, digits with blanks around them
+inline uint64_t contentLength(std::string_view value) {
+    std::string_view v=trimValue(value);
+    if (v.size()==0 || v.size()>19) fail("Bad Content-Length %.*s",int(v.size()),v.data());
+    uint64_t n=0;
+    for (char c:v) {
+        if (c<'0' || c>'9') fail("Bad Content-Length %.*s",int(v.size()),v.data());
+        n=n*10+c-'0';
+    }
+    return n;
+}
+
+// 16 bytes of a value " <urn:uuid:...>" in lower case, empty for other forms
+inline std::string uuidBytes(std::string_view value) {
+    if (value.size()!=48 || value.substr(0,11)!=" <urn:uuid:" || value.back()!='>') return "";
+    std::string bytes;
+    int half=-1;
+    for (size_t k=11; k<47; k++) {
+        char c=value[k];
+        if (k==19 || k==24 || k==29 || k==34) {
+            if (c!='-') return "";
+            continue;
+        }
+        int v=c>='0' && c<='9'?c-'0':c>='a' && c<='f'?c-'a'+10:-1;
+        if (v<0) return "";
+        if (half<0) half=v;
+        else bytes+=char(half<<4|v),half=-1;
+    }
+    return bytes;
+}
+inline std::string uuidValue(std::string_view bytes) {
+    static const char digits[]="0123456789abcdef";
+    std::string v=" <urn:uuid:";
+    for (size_t k=0; k<16; k++) {
+        if (k==4 || k==6 || k==8 || k==10) v+='-';
+        v+=digits[(unsigned char)bytes[k]>>4];
+        v+=digits[bytes[k]&15];
+    }
+    return v+'>';
+}
+
+inline uint64_t zigzag(int64_t v) { return (uint64_t(v)<<1)^uint64_t(v>>63); }
+inline int64_t unzigzag(uint64_t v) { return int64_t(v>>1)^-int64_t(v&1); }
+
+// Fields with coded values in column blocks
+inline bool codedField(int id) {
+    return id==WARC_DATE || id==CONTENT_LENGTH || id==WARC_RECORD_ID || id==WARC_CONCURRENT_TO || id==WARC_REFERS_TO || id==WARC_WARCINFO_ID;
+}
+
+// WARC-Record-IDs of the last RECENT_IDS records and of all warcinfo
+// records, the targets of back-references in column blocks
+class RecordIds {
+    protected:
+        uint64_t n;     // records
+        std::vector<std::string> recent;
+        std::map<uint64_t,std::string> infos;
+        RecordIds(): n(0),recent(RECENT_IDS) { }
+        // WARC-Record-ID of record k, NULL if not kept
+        const std::string *Find(uint64_t k) const {
+            auto it=infos.find(k);
+            if (it!=infos.end()) return &it->second;
+            return k<n && n-k<=RECENT_IDS?&recent[k%RECENT_IDS]:NULL;
+        }
+        void Add(const WarcRecord &record) {
+            int t=record.Find(WARC_TYPE);
+            int j=record.Find(WARC_RECORD_ID);
+            std::string &slot=recent[n%RECENT_IDS];
+            slot=j!=-1?record.Value(j):std::string_view();
+            if (t!=-1 && j!=-1 && trimValue(record.Value(t))=="warcinfo") infos[n]=slot;
+            n++;
+        }
+};
+
+// Column blocks of the header section. A block is a line "C{records} {size}"
+// and size bytes: the layout (varint length, then for each record the version
+// as 0 WARC/1.0, 1 WARC/1.1 or 2 and varint length and string, a varint field
+// count and field ids), then for each field id in rank order the id, a varint
+// length and the values of the field in record order. Values are a varint
+// length and the bytes, for coded fields a varint x that is a coded value
+// when even and the length of the following raw value when odd:
+//   WARC-Date - zigzag difference in seconds to the previous date in the block
+//   Content-Length - the length
+//   WARC-Record-ID - 0 and 16 bytes of the uuid
+//   WARC-Concurrent-To, WARC-Refers-To, WARC-Warcinfo-ID - number of records
+//   back to the one with this WARC-Record-ID
+class ColumnWriter: private RecordIds {
+    private:
+        FILE *out;
+        const std::vector<int> &code;   // field id to encoded id
+        std::string layout;
+        std::string streams[256];
+        size_t count,size;
+        size_t written;                 // bytes of blocks written
+        int64_t date;
+        std::unordered_map<uint64_t,uint64_t> index;  // last record of a Record-ID hash
+        void Value(std::string &s, int id, std::string_view value) {
+            int64_t t;
+            uint64_t len;
+            if (id==WARC_DATE && warcSeconds(value,t)) {
+                putVarint(s,zigzag(t-date)<<1);
+                date=t;
+                return;
+            } else if (id==CONTENT_LENGTH && lengthValue(value,len)) {
+                putVarint(s,len<<1);
+                return;
+            } else if (id==WARC_RECORD_ID) {
+                std::string bytes=uuidBytes(value);
+                if (bytes.size()==16) {
+                    s+=char(0);
+                    s+=bytes;
+                    return;
+                }
+            } else if (id==WARC_CONCURRENT_TO || id==WARC_REFERS_TO || id==WARC_WARCINFO_ID) {
+                auto it=index.find(fastHash(value));
+                const std::string *target=it!=index.end()?Find(it->second):NULL;
+                if (target!=NULL && *target==value) {
+                    putVarint(s,(n-it->second)<<1);
+                    return;
+                }
+            }
+            putVarint(s,codedField(id)?value.size()<<1|1:value.size());
+            s+=value;
+        }
+    public:
+        ColumnWriter(FILE *o, const std::vector<int> &c): out(o),code(c),count(0),size(0),written(0),date(0) { }
+        // The next record is record Count() of the block at Written()
+        size_t Written() const { return written; }
+        size_t Count() const { return count; }
+        void Add(const WarcRecord &record) {
+            if (record.version=="WARC/1.0") layout+=char(0);
+            else if (record.version=="WARC/1.1") layout+=char(1);
+            else {
+                layout+=char(2);
+                putVarint(layout,record.version.size());
+                layout+=record.version;
+            }
+            putVarint(layout,record.fields.size());
+            for (size_t j=0; j<record.fields.size(); j++) {
+                int id=record.fields[j].id;
+                std::string &s=streams[code[id]];
+                size_t before=s.size();
+                layout+=char(code[id]);
+                Value(s,id,record.Value(j));
+                size+=s.size()-before;
+            }
+            // the record that leaves recent is dropped from the index
+            std::string &slot=recent[n%RECENT_IDS];
+            auto it=index.find(fastHash(slot));
+            if (slot.size()>0 && it!=index.end() && it->second+RECENT_IDS==n && infos.count(it->second)==0) index.erase(it);
+            RecordIds::Add(record);
+            if (slot.size()>0) index[fastHash(slot)]=n-1;
+            count++;
+            if (size+layout.size()>=CHUNK_SIZE) Flush();
+        }
+        void Flush() {
+            if (count==0) return;
+            std::string head;
+            putVarint(head,layout.size());
+            size_t total=head.size()+layout.size();
+            for (auto &s:streams) {
+                std::string len;
+                if (s.size()>0) putVarint(len,s.size()),total+=1+len.size()+s.size();
+            }
+            char line[64];
+            int len=snprintf(line,sizeof(line),"C%zu %zu\r\n",count,total);
+            fwrite(line,1,len,out);
+            written+=len+total;
+            fwrite(head.data(),1,head.size(),out);
+            fwrite(layout.data(),1,layout.size(),out);
+            for (int c=0; c<256; c++) {
+                std::string &s=streams[c];
+                if (s.size()==0) continue;
+                std::string len;
+                putVarint(len,s.size());
+                putc(c,out);
+                fwrite(len.data(),1,len.size(),out);
+                fwrite(s.data(),1,s.size(),out);
+                s.clear();
+            }
+            layout.clear();
+            count=size=0;
+            date=0;
+        }
+};
+
+class ColumnReader: private RecordIds {
+    private:
+        const std::vector<int> &ids;    // encoded id to field id
+        std::string block;
+        std::string_view layout;
+        std::string_view streams[256];
+        size_t left;
+        int64_t date;
+        std::string value;
+        static std::string_view Take(std::string_view &s, size_t len) {
+            if (len>s.size()) fail("Corrupt header block");
+            std::string_view v=s.substr(0,len);
+            s.remove_prefix(len);
+            return v;
+        }
+        std::string_view Value(std::string_view &s, int id) {
+            if (s.size()==0) fail("Corrupt header block");
+            uint64_t x=getVarint(s);
+            if (codedField(id)==false) return Take(s,x);
+            if (x&1) return Take(s,x>>1);
+            x>>=1;
+            if (id==WARC_DATE) return value=warcDate(date+=unzigzag(x));
+            if (id==CONTENT_LENGTH) return value=" "+std::to_string(x);
+            if (id==WARC_RECORD_ID) return value=uuidValue(Take(s,16));
+            const std::string *target=Find(n-x);
+            if (target==NULL) fail("Corrupt header block");
+            return *target;
+        }
+    public:
+        explicit ColumnReader(const std::vector<int> &i): ids(i),left(0),date(0) { }
+        bool Read(Reader &in, WarcRecord &record) {
+            if (left==0) {
+                if (in.End()) return false;
+                std::string_view line=in.ReadLine();
+                unsigned long long count=0,size=0;
+                if (line.size()==0 || sscanf(std::string(line).c_str(),"C%llu %llu",&count,&size)!=2) return false;
+                block=std::string(in.ReadBlock(size));
+                if (block.size()!=size) fail("Truncated header block");
+                std::string_view s=block;
+                layout=Take(s,getVarint(s));
+                for (auto &c:streams) c=std::string_view();
+                while (s.size()>0) {
+                    int c=(unsigned char)Take(s,1)[0];
+                    streams[c]=Take(s,getVarint(s));
+                }
+                left=count;
+                date=0;
+                if (left==0) return false;
+            }
+            record.Clear(NULL);
+            int v=(unsigned char)Take(layout,1)[0];
+            if (v==0) record.version="WARC/1.0";
+            else if (v==1) record.version="WARC/1.1";
+            else record.version=Take(layout,getVarint(layout));
+            size_t fields=getVarint(layout);
+            for (size_t k=0; k<fields; k++) {
+                int c=(unsigned char)Take(layout,1)[0];
+                record.Add(ids[c],Value(streams[c],ids[c]),0);
+            }
+            RecordIds::Add(record);
+            left--;
+            return true;
+        }
+        // Moves past the remaining blocks
+        void Skip(Reader &in) {
+            unsigned long long count=0,size=0;
+            std::string_view line;
+            while (in.End()==false && (line=in.ReadLine()).size()>0 && sscanf(std::string(line).c_str(),"C%llu %llu",&count,&size)==2) in.seek(size);
+            left=0;
+        }
+};
+
+// Reads records of the encoded header section, see ENCODED_MAGIC
+class HeaderReader {
+    private:
+        Reader &in;
+        FieldNames &names;
+        bool started;
+        bool held;                      // first line was read by Start
+        bool pack;
+        std::vector<int> ids;           // encoded id to field id
+        std::unique_ptr<ColumnReader> columns;
+        // Reads the dictionary if line is its first line
+        bool Dictionary(std::string_view line) {
+            if (line.substr(0,ENCODED_MAGIC.size())!=ENCODED_MAGIC) return false;
+            std::string_view flags=line.substr(ENCODED_MAGIC.size());
+            bool column=flags.find(" columns")!=std::string_view::npos;
+            pack=flags.find(" pack")!=std::string_view::npos;
+            for (int k=0; line=in.ReadLine(), line.size()>0 && in.End()==false; k++) ids[lineId(k)]=names.Id(line);
+            if (column) columns.reset(new ColumnReader(ids));
+            return true;
+        }
+    public:
+        HeaderReader(Reader &r, FieldNames &f): in(r),names(f),started(false),held(false),pack(false),ids(256) {
+            for (int c=0; c<256; c++) ids[c]=c;
+        }
+        // Reads the dictionary before the first record, false if there is none
+        bool Start() {
+            started=true;
+            held=!Dictionary(in.ReadLine());
+            return !held;
+        }
+        bool Columns() const { return columns!=nullptr; }
+        // Split files are in packs (es -p)
+        bool Pack() const { return pack; }
+        bool Read(WarcRecord &record) {
+            StatTimer timer(STAT_PARSE);
+            if (columns!=nullptr) return columns->Read(in,record);
+            if (in.End()) {
+                return false;
             }
-            std::string line="";
+            std::string_view line;
+            record.Clear(in.Base());
+            line=held?in.LastLine():in.ReadLine();
+            held=false;
+            if (started==false) {
+                started=true;
+                if (Dictionary(line)) {
+                    if (columns!=nullptr) return columns->Read(in,record);
+                    record.Clear(in.Base());
+                    line=in.ReadLine();
+                }
+            }
+            if (line.substr(0,5)=="WARC/") {
+                record.version=line;
+                while (line=in.ReadLine(), line.size()>0 && in.End()==false) {
+                    size_t p=line.find(':');
+                    record.Add(ids[(unsigned char)line[0]],line,std::min(p+1,line.size()));
+                }
+            } else {
+                return false;
+            }
+            line=in.ReadLine();
+            if (in.LineType()!=LTYPE_CRLF) warn("Line type wrong");
+            return true;
+        }
+        // Moves past the header section, column blocks are not decoded
+        void Skip() {
             WarcRecord record;
-            line=file.ReadLine();
-            if (line=="WARC/1.0") {
-                while (line=file.ReadLine(), line.size()>0 && file.End()==false) {
-                    WarcField field;
-                    auto p = std::find(line.begin(), line.end(), ':');
-                    std::string fieldname;
-                    std::move(line.begin(), p, std::back_inserter(fieldname));
-                    int fieldID=line[0];//get_warc_field_id(fieldname);
-                    if (fieldID==-1) {
-                       printf("Unexpected field %s\n", fieldname.c_str());
-                       exit(1);
+            while (columns==nullptr && Read(record));
+            if (columns!=nullptr) columns->Skip(in);
+        }
+};
+
+// Record table at the end of e output, after the content. For each record
+// varints of its header offset (difference to the previous one), its index in
+// a column block (0 for rows) and the size of its content in the content
+// section, then 8 bytes of fastHash of its trimmed WARC-Record-ID. The last
+// line is TABLE_MAGIC and the offsets of the table and of the content section
+// and the record count as 16 hex digits each.
+static const std::string_view TABLE_MAGIC="warc_f/table";
+
+struct TableEntry {
+    uint64_t header;    // offset of the row or column block
+    uint64_t skip;      // records before it in the column block
+    uint64_t content;   // offset in the content section
+    uint64_t size;      // bytes in the content section
+    uint64_t id;        // hash of WARC-Record-ID
+};
+
+inline void writeTable(FILE *out, const std::vector<TableEntry> &table, size_t offset, size_t contentStart) {
+    std::string t;
+    uint64_t prev=0;
+    for (auto &e:table) {
+        putVarint(t,e.header-prev);
+        prev=e.header;
+        putVarint(t,e.skip);
+        putVarint(t,e.size);
+        for (int k=0; k<8; k++) t+=char(e.id>>(k*8));
+    }
+    fwrite(t.data(),1,t.size(),out);
+    fprintf(out,"%s %016zx %016zx %016zx\r\n",TABLE_MAGIC.data(),offset,contentStart,table.size());
+}
+
+// Record table of a file of size bytes, empty if it has none
+inline std::vector<TableEntry> readTable(Reader &in, size_t size, size_t &contentStart) {
+    std::vector<TableEntry> table;
+    size_t line=TABLE_MAGIC.size()+3*17+2;
+    if (size<line) return table;
+    std::string last(in.ReadAt(size-line,line));
+    unsigned long long offset,start,count;
+    if (last.substr(0,TABLE_MAGIC.size())!=TABLE_MAGIC || sscanf(last.c_str()+TABLE_MAGIC.size()," %llx %llx %llx",&offset,&start,&count)!=3 || offset>size-line) return table;
+    std::string data(in.ReadAt(offset,size-line-offset));
+    std::string_view t=data;
+    uint64_t header=0,content=0;
+    for (size_t k=0; k<count; k++) {
+        TableEntry e;
+        header+=getVarint(t);
+        e.header=header;
+        e.skip=getVarint(t);
+        e.size=getVarint(t);
+        e.content=content;
+        content+=e.size;
+        if (t.size()<8) fail("Corrupt record table");
+        e.id=0;
+        for (int b=0; b<8; b++) e.id|=uint64_t((unsigned char)t[b])<<(b*8);
+        t.remove_prefix(8);
+        table.push_back(e);
+    }
+    contentStart=start;
+    return table;
+}
+
+// Command line options
+// Records listed in l mode. HTTP fields are from the response head.
+struct ListFilter {
+    std::string type="response";    // --type, WARC-Type or all
+    std::string mime;               // --mime, Content-Type prefix (HTTP or WARC)
+    std::string status;             // --status, HTTP status code prefix
+    std::string uri;                // --uri, WARC-Target-URI prefix
+};
+
+struct Options {
+    int threads=0;      // -j N, 0 for default
+    bool pack=false;    // -p, split mode parts in pack files
+    bool dedup=false;   // -u, store payloads with same digest once
+    bool normalize=false;   // -n, split content stored de-chunked and decoded
+    bool columns=false; // -c, header section of e and es in column blocks
+    bool pipeline=DefaultThreads()>1;  // input and output in own threads, off with -s
+    std::string stats;  // --stats file, JSON statistics
+    std::string verify; // --verify file, digest report of e and es
+    std::string records;    // --records N[-M],..., records restored by d
+    std::string ids;    // --ids file, WARC-Record-IDs of records restored by d
+    std::string dir;    // directory of split files, empty or ending with '/'
+    bool offsets=false; // gzip member offsets kept for the index of i
+    ListFilter filter;
+};
+
+class WarcFile {
+    friend class WarcReader;
+    private:
+        std::unique_ptr<Reader> input;
+        Reader &file;
+        std::string infile;
+        std::string outfile;
+        RecordStore records;  // headers kept by ReadRecord
+        FieldNames names;
+        WarcRecord current;
+        bool doMergeSplit;
+        bool trailer;
+        int threads;
+        Options opt;
+        size_t contentStart;  // content section of encoded input
+        size_t pending;       // unread content of a streamed record
+        RecordDigest *digest; // digests of the streamed record, if checked
+        std::string_view ReadBlock(Reader &in, size_t size) {
+            StatTimer timer(STAT_READ);
+            return in.ReadBlock(size);
+        }
+        // Copy size bytes of input in chunks, false at end of input
+        bool CopyBlock(Reader &in, size_t size, FILE *out) {
+            while (size>0) {
+                std::string_view block=ReadBlock(in,std::min(size,CHUNK_SIZE));
+                fwrite(block.data(),1,block.size(),out);
+                size-=block.size();
+                if (in.End()) return false;
+            }
+            return true;
+        }
+        // Content of a streamed record in chunks
+        void StreamContent(std::function<void(std::string_view)> f) {
+            while (pending>0) {
+                std::string_view block=ReadBlock(file,std::min(pending,CHUNK_SIZE));
+                pending-=block.size();
+                if (block.size()==0) pending=0;
+                else {
+                    if (digest!=NULL) digest->Update(block);
+                    f(block);
+                }
+            }
+        }
+        // Split files of a streamed record, parts are from the first chunk.
+        // The HTTP header has to be in it, otherwise the content is written whole.
+        void SplitStream(const SplitParts &parts, PackWriter *pack, int i) {
+            size_t size=parts.content.size()+pending;
+            StatTimer timer(STAT_WRITE);
+            if (parts.http) {
+                if (pack!=NULL) fwrite(parts.header.data(),1,parts.header.size(),pack->Open(i,PACK_HEADER,"/",parts.header.size()));
+                else writeContent(opt.dir+"h"+std::to_string(i),parts.header);
+                if (size==0) return;
+            }
+            FILE *out;
+            if (pack!=NULL) out=pack->Open(i,parts.http?PACK_CONTENT:PACK_OTHER,parts.ext,size);
+            else if ((out=fopen((opt.dir+splitName(parts,i)).c_str(),"wb"))==NULL) fail("Can not create %s",(opt.dir+splitName(parts,i)).c_str());
+            fwrite(parts.content.data(),1,parts.content.size(),out);
+            StreamContent([out](std::string_view block) { fwrite(block.data(),1,block.size(),out); });
+            if (pack==NULL) fclose(out);
+        }
+        std::string_view Mime(WarcRecord &record) {
+            int j=record.Find(CONTENT_TYPE);
+            return j!=-1?record.Value(j):std::string_view();
+        }
+        std::string_view Ref(WarcRecord &record) {
+            int j=record.Find(FIELD_PAYLOAD_REF);
+            return j!=-1?record.Value(j):std::string_view();
+        }
+        std::string_view SplitName(WarcRecord &record) {
+            int j=record.Find(FIELD_SPLIT_NAME);
+            return j!=-1?record.Value(j):std::string_view();
+        }
+        // Version and field lines of an encoded header, ids are mapped by code if given
+        static void AppendRow(std::string &row, const WarcRecord &record, const int *code=NULL) {
+            row+=record.version;
+            row+="\r\n";
+            for (size_t j=0; j<record.fields.size(); j++) {
+                int id=record.fields[j].id;
+                row+=char(code!=NULL?code[id]:id);
+                row+=':';
+                row+=record.Value(j);
+                row+="\r\n";
+            }
+        }
+        // Encoded header with fields FIELD_PAYLOAD_REF, FIELD_SPLIT_NAME and
+        // FIELD_NORMAL if ref, name and normal are not empty
+        void WriteHeader(FILE *out, WarcRecord &record, std::string_view ref, std::string_view name, std::string_view normal="") {
+            StatTimer timer(STAT_WRITE);
+            std::string row;
+            AppendRow(row,record);
+            for (auto f:{std::make_pair(FIELD_SPLIT_NAME,name),std::make_pair(FIELD_NORMAL,normal),std::make_pair(FIELD_PAYLOAD_REF,ref)}) {
+                if (f.second.size()==0) continue;
+                row+=char(f.first);
+                row+=": ";
+                row+=f.second;
+                row+="\r\n";
+            }
+            row+="\r\n\r\n";
+            fwrite(row.data(),1,row.size(),out);
+        }
+        // Header section of e and es from the spooled headers: the dictionary
+        // of field names ranked by count, then the records as rows or columns.
+        // Header offsets are set in table if given, returns the section size.
+        size_t WriteHeaders(FILE *out, std::string hdrfile, const size_t *counts, std::vector<TableEntry> *table) {
+            StatTimer timer(STAT_WRITE);
+            std::vector<int> order;
+            for (int id=0; id<FIELD_ID_LIMIT; id++) {
+                if (counts[id]>0) order.push_back(id);
+            }
+            std::stable_sort(order.begin(),order.end(),[counts](int a, int b) { return counts[a]>counts[b]; });
+            // encoded ids, the added fields keep theirs
+            std::vector<int> code(256);
+            for (int id=0; id<256; id++) code[id]=id;
+            size_t pos=fprintf(out,"%s %s%s\r\n",ENCODED_MAGIC.data(),opt.columns?"columns":"rows",doMergeSplit && opt.pack?" pack":"");
+            for (size_t k=0; k<order.size(); k++) {
+                code[order[k]]=lineId(k);
+                if (code[order[k]]>=FIELD_ID_LIMIT) fail("Too many field names");
+                std::string_view name=names.Name(order[k]);
+                fwrite(name.data(),1,name.size(),out);
+                putc(CR,out); putc(LF,out);
+                pos+=name.size()+2;
+            }
+            putc(CR,out); putc(LF,out);
+            pos+=2;
+            Reader in(hdrfile,1,false);
+            HeaderReader spooled(in,names);
+            ColumnWriter columns(out,code);
+            WarcRecord record;
+            std::string row;
+            for (size_t k=0; spooled.Read(record); k++) {
+                if (opt.columns) {
+                    if (table!=NULL) (*table)[k].header=pos+columns.Written(),(*table)[k].skip=columns.Count();
+                    columns.Add(record);
+                    continue;
+                }
+                if (table!=NULL) (*table)[k].header=pos;
+                row.clear();
+                AppendRow(row,record,code.data());
+                row+="\r\n\r\n";
+                fwrite(row.data(),1,row.size(),out);
+                pos+=row.size();
+            }
+            columns.Flush();
+            pos+=columns.Written();
+            in.close();
+            putc(CR,out); putc(LF,out);
+            return pos+2;
+        }
+        // Write one restored record. Content comes from data or from split files,
+        // stored is its size in the content section from the record table.
+        bool WriteRecord(FILE *out, WarcRecord &record, Reader &data, SplitFiles *files, size_t stored=SIZE_MAX) {
+            StatTimer timer(STAT_WRITE);
+            size_t contentSize=0;
+            size_t headerSize=record.version.size()+4;
+            std::string_view ref,normal;
+            fwrite(record.version.data(),1,record.version.size(),out);
+            putc(CR,out); putc(LF,out);
+            for(size_t j=0; j<record.fields.size(); j++) {
+                std::string_view value=record.Value(j);
+                if (record.fields[j].id==CONTENT_LENGTH) contentSize=contentLength(value);
+                if (record.fields[j].id==FIELD_PAYLOAD_REF) {
+                    ref=value;
+                    continue;
+                }
+                if (record.fields[j].id==FIELD_NORMAL) {
+                    normal=trimValue(value);
+                    continue;
+                }
+                if (record.fields[j].id==FIELD_SPLIT_NAME) continue;
+                std::string_view field=names.Name(record.fields[j].id);
+                fwrite(field.data(),1,field.size(),out);
+                putc(':',out);
+                fwrite(value.data(),1,value.size(),out);
+                putc(CR,out); putc(LF,out);
+                headerSize+=field.size()+value.size()+3;
+            }
+            putc(CR,out); putc(LF,out);
+            if (stats.on) {
+                int j=record.Find(WARC_TYPE);
+                stats.Record(j!=-1?record.Value(j):std::string_view(),headerSize,contentSize);
+            }
+            //content
+            if (contentSize) {
+                if (doMergeSplit==false) {
+                    // with a stored payload the content section has the part before it
+                    size_t off=0,len=0;
+                    if (ref.size()>0) sscanf(std::string(ref).c_str(),"%zu %zu",&off,&len);
+                    // a truncated last record has less, it ends without CRLF CRLF
+                    size_t size=contentSize-len;
+                    bool truncated=stored<size;
+                    if (truncated) size=stored;
+                    if (CopyBlock(data,size,out)==false) return false;
+                    for (size_t k=0; k<len; k+=CHUNK_SIZE) {
+                        std::string_view block;
+                        {
+                            StatTimer timer(STAT_READ);
+                            block=data.ReadAt(contentStart+off+k,std::min(CHUNK_SIZE,len-k));
+                        }
+                        fwrite(block.data(),1,block.size(),out);
+                    }
+                    if (truncated) return false;
+                } else {
+                    // split files that were changed or lost do not give the content back
+                    std::string restored;
+                    if (files->header.size()>1 && files->http && normal.size()>0) restored=restorePayload(files->content,normal);
+                    size_t size=files->header.size()>1?files->header.size()+(files->http?4+(normal.size()>0?restored.size():files->Size()):0):files->Size();
+                    if (size!=contentSize) {
+                        int j=record.Find(WARC_RECORD_ID);
+                        fail("Split files of record%.*s have %zu bytes, Content-Length is %zu",j!=-1?int(record.Value(j).size()):0,j!=-1?record.Value(j).data():"",size,contentSize);
+                    }
+                    if (files->header.size()>1) {
+                        fwrite(files->header.data(),1,files->header.size(),out);
+                        if (files->http) {
+                            putc(CR,out); putc(LF,out);
+                            putc(CR,out); putc(LF,out);
+                            if (normal.size()>0) fwrite(restored.data(),1,restored.size(),out);
+                            else files->Write(out);
+                        }
+                    } else {
+                        files->Write(out);
                     }
-                    field.id=fieldID;
-                    p++; // ':'
-                    std::move(p, line.end(), std::back_inserter(field.value));
-                    record.fields.push_back(field);
                 }
-            } else {
-                printf("Records: %d\n ", records.size());
-                DecodeWrite();
-                file.close();
+            }
+            putc(CR,out); putc(LF,out);
+            putc(CR,out); putc(LF,out);
+            return true;
+        }
+    public:
+        // Split files are written by one thread unless set in options.
+        // Gzip input uses all cores by default.
+        WarcFile(std::string filename,std::string fileout,bool ms,const Options &o=Options()) : input(new Reader(filename,o.threads>0?o.threads:DefaultThreads(),true,o.pipeline,o.offsets)),file(*input),infile(filename),outfile(fileout),doMergeSplit(ms),trailer(false),threads(o.threads>0?o.threads:1),opt(o),contentStart(0),pending(0),digest(NULL) { };
+        // Input from a reader of the caller (buffer or function), for parsing only
+        explicit WarcFile(std::unique_ptr<Reader> in,const Options &o=Options()) : input(std::move(in)),file(*input),infile(file.Name()),doMergeSplit(false),trailer(false),threads(o.threads>0?o.threads:1),opt(o),contentStart(0),pending(0),digest(NULL) { };
+        // Id of a field name in this file, vendor fields get theirs before parsing
+        int FieldId(std::string_view name) { return names.Id(name); }
+        bool ParseRecord(WarcRecord &record, bool doContent=true) {
+            StatTimer timer(STAT_PARSE);
+            // record end of previous record is read here to keep content view valid
+            if (trailer==true) {
+                trailer=false;
+                if (pending>0) file.seek(pending),pending=0;
+                file.ReadLine();
+                if (file.LineType()!=LTYPE_CRLF) warn("Line type wrong");
+                file.ReadLine();
+                if (file.LineType()!=LTYPE_CRLF) warn("Line type wrong");
+            }
+            if (file.End()) {
                 return false;
             }
-            records.push_back(record);
+            std::string_view line;
+            record.Clear(file.Base());
+            record.offset=file.Tell();
             line=file.ReadLine();
-            if (file.LineType()!=LTYPE_CRLF) printf("Line type wrong\n");
+            if (line.substr(0,5)=="WARC/"){
+                record.version=line;
+                while (line=file.ReadLine(), line.size()>0 && file.End()==false) {
+                    size_t p=line.find(':');
+                    if (p==std::string_view::npos) fail("Unexpected line %.*s",int(line.size()),line.data());
+                    record.Add(names.Id(line.substr(0,p)),line,p+1);
+               }
+            } else {
+                return false;
+            }
+            record.headerSize=file.Tell()-record.offset;
+            size_t contentSize=0;
+            int j=record.Find(CONTENT_LENGTH);
+            if (j!=-1) contentSize=contentLength(record.Value(j));
+            record.contentSize=contentSize;
+            // in list mode skip content reading and seek to next entry
+            if (doContent==true && file.Mapped()==false && contentSize>STREAM_SIZE) {
+                record.stream=true;
+                pending=contentSize;
+            } else if (doContent==true) {
+                record.content=ReadBlock(file,contentSize);
+                if (contentSize!=record.content.size()) {
+                   warn("Content not same size %zu %zu",contentSize,record.content.size());
+                }
+            } else {
+                // skipped when the next record is parsed, see Peek
+                pending=contentSize;
+            }
+            if (stats.on) {
+                int t=record.Find(WARC_TYPE);
+                stats.Record(t!=-1?record.Value(t):std::string_view(),record.headerSize,contentSize);
+            }
+            trailer=true;
+            return true;
+        }
+        // Parse next record and keep its fields in ids (all if empty) in records
+        bool ReadRecord(bool doContent=true, const std::vector<int> &ids={}) {
+            if (!ParseRecord(current,doContent)) return false;
+            records.Add(current,ids);
             return true;
         }
 
-        void ListWARC(int field) {
+        int VerifyThreads() { return opt.threads>0?opt.threads:DefaultThreads(); }
+        // Digests of content, in the pool if any. content is a view into
+        // mapped input or into copy.
+        void Verify(DigestCheck &check, ThreadPool *pool, std::shared_ptr<RecordDigest> r, std::string_view content, std::shared_ptr<std::string> copy) {
+            if (pool==NULL) {
+                r->Update(content);
+                check.Finish(*r);
+                return;
+            }
+            pool->Wait(pool->Size()*4);
+            pool->Run([&check,r,content,copy] {
+                r->Update(content);
+                check.Finish(*r);
+            });
+        }
+
+        // Check block and payload digests of all records while reading ahead,
+        // mismatches are written to outfile. Fails if any digest differs.
+        int VerifyWARC() {
+            DigestCheck check;
+            std::unique_ptr<ThreadPool> pool;
+            if (VerifyThreads()>1) pool.reset(new ThreadPool(VerifyThreads()));
+            WarcRecord record;
+            int i=0;
+            while (ParseRecord(record)) {
+                auto r=check.Start(record,i++);
+                if (r==nullptr) continue;
+                if (record.stream==true) {
+                    digest=r.get();
+                    StreamContent([](std::string_view) { });
+                    digest=NULL;
+                    check.Finish(*r);
+                    continue;
+                }
+                std::shared_ptr<std::string> copy;
+                std::string_view content=record.content;
+                if (pool!=nullptr && file.Mapped()==false) copy=std::make_shared<std::string>(content),content=*copy;
+                Verify(check,pool.get(),r,content,copy);
+            }
+            if (pool!=nullptr) pool->Wait();
+            file.close();
+            size_t failed=check.Write(outfile);
+            if (failed>0) fail("%zu digests do not match in %s",failed,infile.c_str());
+            return i;
+        }
+
+        // Headers are written as records are read, content is spooled
+        // to a temporary file next to the output and appended at the end.
+        int EncodeWARC() {
+            FILE *outfd=fopen(outfile.c_str(),"wb");
+            if (outfd==NULL) fail("Can not create %s",outfile.c_str());
+            WriteBehind output(outfd,opt.pipeline);
+            FILE *out=output.File();
+            std::string spoolfile=outfile+".tmp";
+            FILE *spoolfd=NULL;
+            if (doMergeSplit==false) {
+                spoolfd=fopen(spoolfile.c_str(),"w+b");
+                if (spoolfd==NULL) fail("Can not create %s",spoolfile.c_str());
+            }
+            WriteBehind spooled(spoolfd,opt.pipeline);
+            FILE *spool=spooled.File();
+            // headers are spooled with field ids until the dictionary is known
+            std::string hdrfile=outfile+".hdr.tmp";
+            FILE *hdrfd=fopen(hdrfile.c_str(),"wb");
+            if (hdrfd==NULL) fail("Can not create %s",hdrfile.c_str());
+            WriteBehind headers(hdrfd,opt.pipeline);
+            size_t counts[256]={};
+            // split files are written by the pool, content is copied
+            // when it is not a view into mapped input
+            std::unique_ptr<ThreadPool> pool;
+            std::unique_ptr<PackWriter> pack;
+            if (doMergeSplit==true && opt.pack==true) pack.reset(new PackWriter(outfile));
+            else if (doMergeSplit==true && threads>1) pool.reset(new ThreadPool(threads));
+            // digests are checked by their own pool
+            std::unique_ptr<DigestCheck> check;
+            std::unique_ptr<ThreadPool> checks;
+            if (opt.verify.size()>0) check.reset(new DigestCheck());
+            if (check!=nullptr && VerifyThreads()>1) checks.reset(new ThreadPool(VerifyThreads()));
+            PayloadStore store;
+            size_t spoolsize=0;
+            std::vector<TableEntry> table;
+            WarcRecord record;
+            int i=0;
+            while (ParseRecord(record)) {
+                // content to split, for a streamed record the first chunk. Content
+                // is copied for the pool when it is not a view into mapped input.
+                std::string_view content=record.content;
+                std::shared_ptr<std::string> copy;
+                if (record.stream==true && doMergeSplit==true) {
+                    content=ReadBlock(file,std::min(pending,CHUNK_SIZE));
+                    pending-=content.size();
+                } else if ((pool!=nullptr || checks!=nullptr) && file.Mapped()==false && content.size()>0) {
+                    copy=std::make_shared<std::string>(content);
+                    content=*copy;
+                }
+                std::shared_ptr<RecordDigest> recordDigest;
+                if (check!=nullptr) {
+                    recordDigest=check->Start(record,i);
+                    if (recordDigest!=nullptr && record.stream==true) recordDigest->Update(content),digest=recordDigest.get();
+                    else if (recordDigest!=nullptr) Verify(*check,checks.get(),recordDigest,content,copy);
+                }
+                SplitParts parts;
+                if (content.size()>0 && (doMergeSplit==true || opt.dedup==true)) parts=splitParts(content,Mime(record));
+                // normalized content is restored from FIELD_NORMAL, it is not deduplicated
+                std::string normal;
+                if (doMergeSplit==true && opt.normalize==true && record.stream==false) normal=normalizePayload(parts);
+                // payload with same digest as an earlier one is replaced by a
+                // reference to where the earlier copy is stored
+                std::string ref;
+                int j=record.Find(WARC_PAYLOAD_DIGEST);
+                if (opt.dedup==true && j!=-1 && record.stream==false && content.size()>0 && normal.size()==0) {
+                    std::string location;
+                    if (doMergeSplit==false) location=std::to_string(spoolsize+content.size()-parts.content.size());
+                    else if (pack!=nullptr) location=pack->Location(parts);
+                    else location=splitName(parts,i);
+                    const std::string *found=store.Find(record.Value(j),parts.content,location);
+                    if (found!=NULL) ref=*found+" "+std::to_string(parts.content.size());
+                }
+                bool payload=ref.size()==0;
+                std::string name;
+                if (doMergeSplit==true && pack==nullptr && content.size()>0) name=splitName(parts,i);
+                for (auto &f:record.fields) counts[f.id]++;
+                WriteHeader(headers.File(),record,ref,name,normal);
+                if (doMergeSplit==false) {
+                    int id=record.Find(WARC_RECORD_ID);
+                    table.push_back({0,0,spoolsize,0,fastHash(id!=-1?trimValue(record.Value(id)):std::string_view())});
+                    if (record.stream==true) {
+                        StreamContent([spool,&spoolsize](std::string_view block) {
+                            StatTimer timer(STAT_WRITE);
+                            fwrite(block.data(),1,block.size(),spool);
+                            spoolsize+=block.size();
+                        });
+                    } else {
+                        if (payload==false) content.remove_suffix(parts.content.size());
+                        StatTimer timer(STAT_WRITE);
+                        fwrite(content.data(),1,content.size(),spool);
+                        spoolsize+=content.size();
+                    }
+                    table.back().size=spoolsize-table.back().content;
+                } else if (record.stream==true) {
+                    SplitStream(parts,pack.get(),i);
+                } else if (content.size()>0) {
+                    //split mode
+                    if (pack!=nullptr) {
+                        pack->Write(parts,i,payload);
+                    } else if (pool==nullptr) {
+                        splitContent(opt.dir,parts,i,payload);
+                    } else {
+                        pool->Wait(threads*4);
+                        pool->Run([this,copy,parts,i,payload] { splitContent(opt.dir,parts,i,payload); });
+                    }
+                }
+                // dm checks the size of split files against Content-Length
+                if (doMergeSplit==true && file.Tell()<record.offset+record.headerSize+record.contentSize) fail("Record %d is truncated, es can not restore it",i);
+                if (digest!=NULL) check->Finish(*digest),digest=NULL;
+                i++;
+            }
+            if (pool!=nullptr) pool->Wait();
+            if (checks!=nullptr) checks->Wait();
+            if (check!=nullptr) check->Write(opt.verify);
+            if (pack!=nullptr) pack->Close();
+            headers.Close();
+            fclose(hdrfd);
+            size_t start=WriteHeaders(out,hdrfile,counts,doMergeSplit?NULL:&table);
+            remove(hdrfile.c_str());
+            // content
+            if (spoolfd!=NULL) {
+                StatTimer timer(STAT_WRITE);
+                spooled.Close();
+                std::string buf(1<<20,0);
+                rewind(spoolfd);
+                size_t len;
+                while ((len=fread(&buf[0],1,buf.size(),spoolfd))>0) fwrite(&buf[0],1,len,out);
+                fclose(spoolfd);
+                remove(spoolfile.c_str());
+                writeTable(out,table,start+spoolsize,start);
+            }
+            output.Close();
+            fclose(outfd);
+            file.close();
+            return i;
+        }
+
+        // Restore the records chosen with --records and --ids, at offsets from
+        // the record table. Content and rows are read at their offset, column
+        // blocks are decoded in order as values refer to earlier records.
+        int DecodeRecords() {
+            if (doMergeSplit) fail("Records can be chosen only for e output");
+            struct stat st;
+            if (stat(infile.c_str(),&st)!=0) fail("Input file not found: %s",infile.c_str());
+            Reader data(infile,1,false);
+            std::vector<TableEntry> table=readTable(data,st.st_size,contentStart);
+            if (table.size()==0) fail("No record table in %s",infile.c_str());
+            // 1 chosen by number, 2 by WARC-Record-ID hash
+            std::vector<char> chosen(table.size(),0);
+            for (size_t p=0,e; p<opt.records.size(); p=e+1) {
+                e=std::min(opt.records.find(',',p),opt.records.size());
+                std::string range=opt.records.substr(p,e-p);
+                unsigned long long a=0,b=0;
+                int n=sscanf(range.c_str(),"%llu-%llu",&a,&b);
+                if (n<1) fail("Bad record range %s",range.c_str());
+                if (n==1) b=range.back()=='-'?table.size():a;
+                for (uint64_t k=a; k<=b && k<table.size(); k++) chosen[k]=1;
+            }
+            std::map<std::string,int,std::less<>> ids;
+            if (opt.ids.size()>0) {
+                std::string list=readFile(opt.ids);
+                for (size_t p=0,e; p<list.size(); p=e+1) {
+                    e=std::min(list.find(LF,p),list.size());
+                    std::string_view id=std::string_view(list).substr(p,e-p);
+                    if (id.size()>0 && id.back()==CR) id.remove_suffix(1);
+                    id=trimValue(id);
+                    if (id.size()>0) ids[std::string(id)]=0;
+                }
+                std::map<uint64_t,int> hashes;
+                for (auto &id:ids) hashes[fastHash(id.first)]=0;
+                for (size_t k=0; k<table.size(); k++) {
+                    if (chosen[k]==0 && hashes.count(table[k].id)) chosen[k]=2;
+                }
+            }
             FILE *out=fopen(outfile.c_str(),"wb");
-            for(auto i=0; i <records.size(); i++) {
-                int fid=-1;
-                int tid=-1;
-                std::string value="";
-                for(auto j=0; j<records[i].fields.size(); j++) { 
-                    if (fid==-1 && records[i].fields[j].id==WARC_TYPE && records[i].fields[j].value==" response") {
-                        fid=records[i].fields[j].id; 
-                    } if (tid==-1 && records[i].fields[j].id==field) {
-                        tid=records[i].fields[j].id;
-                        value=records[i].fields[j].value;
+            if (out==NULL) fail("Can not create %s",outfile.c_str());
+            HeaderReader headers(file,names);
+            if (headers.Start()==false) fail("No record table in %s",infile.c_str());
+            WarcRecord record;
+            size_t next=0;      // next record of column blocks
+            int n=0;
+            for (size_t k=0; k<table.size(); k++) {
+                if (chosen[k]==0) continue;
+                if (headers.Columns()) {
+                    while (next<=k && headers.Read(record)) next++;
+                    if (next<=k) fail("Corrupt record table");
+                } else {
+                    if (table[k].header<file.Tell()) fail("Corrupt record table");
+                    file.seek(table[k].header-file.Tell());
+                    if (headers.Read(record)==false) fail("Corrupt record table");
+                }
+                int j=record.Find(WARC_RECORD_ID);
+                if (chosen[k]==2 && (j==-1 || ids.count(trimValue(record.Value(j)))==0)) continue;
+                data.seek(contentStart+table[k].content-data.Tell());
+                WriteRecord(out,record,data,NULL,table[k].size);
+                n++;
+            }
+            fclose(out);
+            data.close();
+            file.close();
+            return n;
+        }
+
+        // Headers are read and written one record at a time. In non split mode
+        // a second reader is positioned past the header section for the content.
+        int DecodeWARC() {
+            if (opt.records.size()>0 || opt.ids.size()>0) return DecodeRecords();
+            // content is read by a second reader, a pipe would be at its end
+            struct stat st;
+            if (doMergeSplit==false && (stat(infile.c_str(),&st)!=0 || S_ISREG(st.st_mode)==false)) fail("d needs a seekable input");
+            Reader data(infile,DefaultThreads(),true,opt.pipeline && doMergeSplit==false);
+            WarcRecord record;
+            HeaderReader headers(file,names);
+            std::vector<TableEntry> table;
+            if (doMergeSplit==false) {
+                HeaderReader(data,names).Skip();
+                contentStart=data.Tell();
+                size_t start;
+                Reader in(infile,1,false);
+                table=readTable(in,st.st_size,start);
+                in.close();
+            } else {
+                // files of earlier versions have no dictionary, their packs are found by name
+                bool packed=headers.Start()?headers.Pack():access((infile+".ptab").c_str(),F_OK)==0;
+                if (packed!=opt.pack) fail(packed?"%s has split files in packs, dm needs -p":"%s has no packs, dm without -p",infile.c_str());
+            }
+            FILE *outfd=fopen(outfile.c_str(),"wb");
+            if (outfd==NULL) fail("Can not create %s",outfile.c_str());
+            WriteBehind output(outfd,opt.pipeline);
+            FILE *out=output.File();
+            int i=0;
+            if (doMergeSplit==false) {
+                while (headers.Read(record)) {
+                    bool more=WriteRecord(out,record,data,NULL,size_t(i)<table.size()?table[i].size:SIZE_MAX);
+                    i++;
+                    if (more==false) break;
+                }
+                if (table.size()>0 && size_t(i)!=table.size()) fail("%d records restored, the record table has %zu",i,table.size());
+            } else if (opt.pack==true) {
+                PackReader pack(infile);
+                while (headers.Read(record)) {
+                    SplitFiles files=pack.Load(i,Ref(record));
+                    WriteRecord(out,record,data,&files);
+                    i++;
+                }
+                pack.Close();
+            } else if (threads==1) {
+                while (headers.Read(record)) {
+                    SplitFiles files=loadSplit(opt.dir,SplitName(record),Mime(record),Ref(record),i);
+                    WriteRecord(out,record,data,&files);
+                    i++;
+                }
+            } else {
+                // split files of the next records are read by the pool
+                // while the current record is written
+                struct Prefetch {
+                    WarcRecord record;
+                    SplitFiles files;
+                    std::string error;
+                    bool ready=false;
+                    std::mutex lock;
+                    std::condition_variable cv;
+                };
+                ThreadPool pool(threads);
+                std::deque<std::shared_ptr<Prefetch>> queue;
+                bool more=true;
+                while (true) {
+                    while (more==true && queue.size()<size_t(threads*4)) {
+                        auto p=std::make_shared<Prefetch>();
+                        if (headers.Read(p->record)==false) {
+                            more=false;
+                            break;
+                        }
+                        int n=i+queue.size();
+                        pool.Run([this,p,n,name=std::string(SplitName(p->record)),mime=std::string(Mime(p->record)),ref=std::string(Ref(p->record))] {
+                            SplitFiles files;
+                            std::string error;
+                            try {
+                                files=loadSplit(opt.dir,name,mime,ref,n);
+                            } catch (std::exception &e) {
+                                error=e.what();
+                            }
+                            std::lock_guard<std::mutex> l(p->lock);
+                            p->files=std::move(files);
+                            p->error=error;
+                            p->ready=true;
+                            p->cv.notify_all();
+                        });
+                        queue.push_back(p);
                     }
+                    if (queue.empty()) break;
+                    auto p=queue.front();
+                    queue.pop_front();
+                    {
+                        std::unique_lock<std::mutex> l(p->lock);
+                        p->cv.wait(l, [&p]{ return p->ready; });
+                    }
+                    if (p->error.size()>0) fail("%s",p->error.c_str());
+                    WriteRecord(out,p->record,data,&p->files);
+                    i++;
+                }
+            }
+            output.Close();
+            fclose(outfd);
+            data.close();
+            file.close();
+            return i;
+        }
+
+        // Write CDXJ index sorted by URI key. Offsets are positions in the input.
+        // For gzip input offset and length are those of the gzip members of the
+        // record, skip is the position of the record in the inflated members.
+        // Headers are kept in records, lines are made while writing.
+        int IndexWARC() {
+            const int KEY=0xfc;     // SURT key and date, not a WARC field
+            std::vector<std::pair<size_t,size_t>> members;    // compressed and inflated start
+            while (ReadRecord(false,{WARC_TARGET_URI,WARC_TYPE,WARC_RECORD_ID,CONTENT_LENGTH})) {
+                std::string_view uri=trimValue(records.Value(records.Size()-1,WARC_TARGET_URI));
+                int j=current.Find(WARC_DATE);
+                records.Add(KEY,(uri.size()>0?surtKey(uri):"-")+" "+cdxDate(j!=-1?current.Value(j):std::string_view()));
+                size_t start,inflated;
+                if (file.Member(current.offset,start,inflated)) members.emplace_back(start,inflated);
+            }
+            if (members.size()!=records.Size()) members.clear();
+            // members of a record end where the member of a later record starts
+            std::vector<size_t> lengths(members.size());
+            if (members.size()>0) {
+                struct stat st;
+                size_t end=stat(infile.c_str(),&st)==0?st.st_size:0;
+                for (size_t r=members.size(); r-->0;) {
+                    lengths[r]=end-members[r].first;
+                    if (r>0 && members[r-1].first<members[r].first) end=members[r].first;
                 }
-                if (fid!=-1 && tid!=-1) {
-                    if (value.size()>1)
-                        fprintf(out,"%s\n",&value[1]); // skip first byte (space)
+            }
+            auto value=[this](size_t r, int id) { return trimValue(records.Value(r,id)); };
+            // same order as sorted lines, values compare as JSON strings
+            // ending with '"' (no escaped characters in URIs and ids)
+            auto compare=[](std::string_view a, std::string_view b) {
+                size_t n=std::min(a.size(),b.size());
+                int c=memcmp(a.data(),b.data(),n);
+                if (c!=0 || a.size()==b.size()) return c;
+                return a.size()>n?(unsigned char)a[n]-'"':'"'-(unsigned char)b[n];
+            };
+            std::vector<std::pair<std::string_view,uint32_t>> order(records.Size());
+            for (size_t r=0; r<order.size(); r++) order[r]={records.Value(r,KEY),r};
+            std::sort(order.begin(), order.end(), [this,&value,&compare](const auto &a, const auto &b) {
+                int c=a.first.compare(b.first);
+                if (c!=0) return c<0;
+                for (int id:{WARC_TARGET_URI,WARC_TYPE,WARC_RECORD_ID}) {
+                    if ((c=compare(value(a.second,id),value(b.second,id)))!=0) return c<0;
+                }
+                return records.Offset(a.second)<records.Offset(b.second);
+            });
+            FILE *out=fopen(outfile.c_str(),"wb");
+            if (out==NULL) fail("Can not create %s",outfile.c_str());
+            std::string filename=jsonString(infile),line;
+            for (auto [key,r]:order) {
+                std::string_view length=value(r,CONTENT_LENGTH);
+                line.assign(key);
+                line+=" {\"url\":"+jsonString(value(r,WARC_TARGET_URI));
+                line+=",\"type\":"+jsonString(value(r,WARC_TYPE));
+                line+=",\"id\":"+jsonString(value(r,WARC_RECORD_ID));
+                if (members.size()>0) {
+                    line+=",\"offset\":"+std::to_string(members[r].first)+",\"length\":"+std::to_string(lengths[r]);
+                    if (records.Offset(r)>members[r].second) line+=",\"skip\":"+std::to_string(records.Offset(r)-members[r].second);
+                } else line+=",\"offset\":"+std::to_string(records.Offset(r));
+                line+=",\"hlen\":"+std::to_string(records.HeaderSize(r));
+                line+=",\"clen\":";
+                line+=length.size()>0?length:"0";
+                line+=",\"filename\":"+filename+"}\n";
+                fwrite(line.data(),1,line.size(),out);
+            }
+            fclose(out);
+            file.close();
+            return order.size();
+        }
+
+        // Write records matching key (URI or WARC-Record-ID) from the input index.
+        // Records are read from the WARC files named in the index at the indexed offset.
+        int ExtractWARC(std::string key) {
+            std::vector<std::string> lines;
+            std::vector<std::string> match;
+            std::string_view line;
+            while (line=file.ReadLine(), line.size()>0 || file.End()==false) {
+                if (line.size()>0) lines.push_back(std::string(line));
+            }
+            std::string id=key;
+            if (id.size()>0 && id[0]!='<') id="<"+id+">";
+            if (id.substr(0,5)=="<urn:") {
+                std::string f="\"id\":"+jsonString(id);
+                for (auto &l:lines) if (l.find(f)!=std::string::npos) match.push_back(l);
+            } else {
+                std::string k=surtKey(key)+" ";
+                auto it=std::lower_bound(lines.begin(), lines.end(), k);
+                while (it!=lines.end() && it->compare(0,k.size(),k)==0) match.push_back(*it++);
+            }
+            struct Location {
+                std::string filename;
+                size_t offset;
+                size_t size;
+                size_t length;  // of gzip members, 0 for other input
+                size_t skip;    // of inflated members before the record
+                bool operator<(const Location &b) const { return filename<b.filename || (filename==b.filename && (offset<b.offset || (offset==b.offset && skip<b.skip))); }
+            };
+            std::vector<Location> locs;
+            for (auto &l:match) {
+                Location loc;
+                loc.filename=jsonValue(l,"filename");
+                loc.offset=std::stoull(jsonValue(l,"offset"));
+                // record ends with CRLF CRLF
+                loc.size=std::stoull(jsonValue(l,"hlen"))+std::stoull(jsonValue(l,"clen"))+4;
+                std::string length=jsonValue(l,"length"),skip=jsonValue(l,"skip");
+                loc.length=length.size()>0?std::stoull(length):0;
+                loc.skip=skip.size()>0?std::stoull(skip):0;
+                locs.push_back(loc);
+            }
+            std::sort(locs.begin(), locs.end());
+            FILE *out=fopen(outfile.c_str(),"wb");
+            if (out==NULL) fail("Can not create %s",outfile.c_str());
+            for (size_t i=0; i<locs.size(); i++) {
+                Reader in(locs[i].filename,threads,locs[i].length==0);
+                size_t pos=0;
+                for (; i<locs.size() && locs[i].filename==in.Name(); i++) {
+                    if (locs[i].length>0) {
+                        // only the gzip members of the record are inflated
+                        std::string_view members=in.ReadAt(locs[i].offset,locs[i].length);
+                        Reader z(members.data(),members.size(),1);
+                        z.seek(locs[i].skip);
+                        CopyBlock(z,locs[i].size,out);
+                        continue;
+                    }
+                    in.seek(locs[i].offset-pos);
+                    CopyBlock(in,locs[i].size,out);
+                    pos=locs[i].offset+locs[i].size;
                 }
-             }
+                i--;
+                in.close();
+            }
             fclose(out);
-            printf("Records: %d\n ",records.size());
+            file.close();
+            return locs.size();
+        }
+
+        // Up to size bytes from the start of the content of a record parsed
+        // without content
+        std::string_view Peek(size_t size) {
+            std::string_view head=ReadBlock(file,std::min(size,pending));
+            pending-=head.size();
+            return head;
+        }
+        // List fields of records matching opt.filter, one line per record
+        // with values separated by tabs ("-" if missing). Lines are written
+        // as records are read. Output "-" is stdout.
+        int ListWARC(const std::vector<int> &list) {
+            const ListFilter &filter=opt.filter;
+            FILE *out=outfile=="-"?stdout:fopen(outfile.c_str(),"wb");
+            if (out==NULL) fail("Can not create %s",outfile.c_str());
+            bool http=filter.mime.size()>0 || filter.status.size()>0;
+            WarcRecord record;
+            int i=0;
+            for (; ParseRecord(record,false); i++) {
+                int j;
+                if (filter.type!="all" && ((j=record.Find(WARC_TYPE))==-1 || trimValue(record.Value(j))!=filter.type)) continue;
+                if (filter.uri.size()>0 && ((j=record.Find(WARC_TARGET_URI))==-1 || trimValue(record.Value(j)).substr(0,filter.uri.size())!=filter.uri)) continue;
+                if (http) {
+                    std::string_view head=Peek(HEAD_SIZE);
+                    HttpHead h=parseHttp(head);
+                    std::string_view status=h.status;
+                    std::string_view mime=status.size()>0?h.type:trimValue(Mime(record));
+                    if (filter.status.size()>0 && status.substr(0,filter.status.size())!=filter.status) continue;
+                    if (filter.mime.size()>0 && mime.substr(0,filter.mime.size())!=filter.mime) continue;
+                }
+                if (list.size()==1) {
+                    // single field, records without it are left out
+                    j=record.Find(list[0]);
+                    if (j==-1 || record.Value(j).size()<=1) continue;
+                    std::string_view value=record.Value(j);
+                    fwrite(value.data()+1,1,value.size()-1,out); // skip first byte (space)
+                    putc(LF,out);
+                    continue;
+                }
+                for (size_t k=0; k<list.size(); k++) {
+                    if (k>0) putc('\t',out);
+                    j=record.Find(list[k]);
+                    std::string_view value=j!=-1?record.Value(j):std::string_view();
+                    if (value.size()>1) fwrite(value.data()+1,1,value.size()-1,out);
+                    else putc('-',out);
+                }
+                putc(LF,out);
+            }
+            if (out!=stdout) fclose(out);
+            file.close();
+            return i;
         }
 };
+
+// Records of a WARC file or .warc.gz for use as a library, build with
+// -DWARC_F_LIBRARY to leave out main. Records are pulled with Next, content
+// is read when asked for and skipped otherwise. Nothing is thrown or printed:
+// Next returns false at the end of input or on an error, Error tells which.
+// Warnings go to the warnings handler.
+//
+//     WarcReader warc(data,size);
+//     while (warc.Next()) {
+//         if (warc.Field(WARC_TYPE)==" response") use(warc.Field(WARC_TARGET_URI),warc.Content());
+//     }
+//     if (warc.Error().size()>0) ...
+class WarcReader {
+    private:
+        std::unique_ptr<WarcFile> warc;
+        WarcRecord record;
+        bool read;          // content of record is read or being read
+        std::string error;
+        bool Try(std::function<void()> f) {
+            try {
+                f();
+                return true;
+            } catch (std::exception &e) {
+                error=e.what();
+                return false;
+            }
+        }
+        void Open(std::function<Reader *()> open, const Options &o) {
+            read=true;
+            Try([&] { warc.reset(new WarcFile(std::unique_ptr<Reader>(open()),o)); });
+        }
+    public:
+        explicit WarcReader(std::string filename, const Options &o=Options()) {
+            Open([&] { return new Reader(filename,o.threads>0?o.threads:DefaultThreads()); },o);
+        }
+        // Buffer of the caller, valid while records are read
+        WarcReader(const char *data, size_t size, const Options &o=Options()) {
+            Open([&] { return new Reader(data,size,o.threads>0?o.threads:DefaultThreads()); },o);
+        }
+        // Function of the caller, see Reader
+        explicit WarcReader(std::function<size_t(char *, size_t)> f, const Options &o=Options()) {
+            Open([&] { return new Reader(f); },o);
+        }
+        // Next record, false at the end of input or on an error
+        bool Next() {
+            bool more=false;
+            if (warc!=nullptr && error.size()==0) Try([&] { more=warc->ParseRecord(record,false); });
+            read=false;
+            return more;
+        }
+        // Version, fields by id, offset and sizes. Values are valid until Next.
+        const WarcRecord &Record() const { return record; }
+        // Value of the first field with id, empty if the record has none
+        std::string_view Field(int id) const {
+            int j=record.Find(id);
+            return j!=-1?record.Value(j):std::string_view();
+        }
+        // Value of the first field with name, also for fields not in WARC_FIELDS
+        std::string_view Field(std::string_view name) const {
+            for (size_t j=0; j<record.fields.size(); j++) {
+                if (warc->names.Name(record.fields[j].id)==name) return record.Value(j);
+            }
+            return std::string_view();
+        }
+        std::string_view FieldName(int id) const { return warc!=nullptr?warc->names.Name(id):std::string_view(); }
+        // Whole content, valid until Next. It is held in memory unless the
+        // input is mapped, see ReadContent for large records.
+        std::string_view Content() {
+            if (read) return record.content;
+            read=true;
+            Try([&] {
+                record.content=warc->ReadBlock(warc->file,warc->pending);
+                warc->pending=0;
+                if (record.content.size()!=record.contentSize) fail("Content not same size %zu %zu",record.contentSize,record.content.size());
+            });
+            return record.content;
+        }
+        // Content in chunks of up to CHUNK_SIZE, false on an error
+        bool ReadContent(std::function<void(std::string_view)> f) {
+            if (read) {
+                if (record.content.size()>0) f(record.content);
+                return error.size()==0;
+            }
+            read=true;
+            size_t size=record.contentSize;
+            return Try([&] {
+                warc->StreamContent([&](std::string_view block) { size-=block.size(),f(block); });
+                if (size>0) fail("Content not same size %zu %zu",record.contentSize,record.contentSize-size);
+            });
+        }
+        // Empty unless Next stopped on an error
+        const std::string &Error() const { return error; }
+};
+
+// True if files have the same content, a may be gzip compressed
+inline bool sameContent(std::string a, std::string b) {
+    Reader ra(a),rb(b,1,false);
+    bool same=true;
+    while (same) {
+        std::string_view x=ra.ReadBlock(1<<20),y=rb.ReadBlock(1<<20);
+        same=x==y;
+        if (x.size()==0) break;
+    }
+    ra.close();
+    rb.close();
+    return same;
 }
 
-using namespace warcfile;
+// Header parse cost per field: ns per field name lookup (id and name) over
+// the header field names of input, with the table and with a linear scan
+// over std::string names as it was done before the table.
+inline std::pair<double,double> benchFieldLookup(std::string input, size_t &count) {
+    std::vector<std::string> fields;
+    Reader in(input);
+    while (fields.size()<(1<<20)) {
+        std::string_view line=in.ReadLine();
+        if (in.End() && line.size()==0) break;
+        if (line.substr(0,5)!="WARC/") continue;
+        size_t len=0;
+        while ((line=in.ReadLine()).size()>0) {
+            size_t p=line.find(':');
+            if (p==std::string_view::npos) continue;
+            fields.emplace_back(line.substr(0,p));
+            if (fields.back()=="Content-Length") len=strtoull(std::string(line.substr(p+1)).c_str(),NULL,10);
+        }
+        in.seek(len);
+    }
+    in.close();
+    count=fields.size();
+    if (count==0) return {0,0};
+    std::vector<std::string> names(WARC_FIELD_COUNT);
+    for (int i=0; i<WARC_FIELD_COUNT; i++) names[i]=WARC_FIELDS[i].value;
+    auto linear=[&](std::string name) {
+        for (int i=0; i<WARC_FIELD_COUNT; i++) if (names[i]==name) return i;
+        return -1;
+    };
+    volatile size_t sink=0;
+    auto time=[&](std::function<size_t(const std::string &)> f) {
+        size_t n=0,sum=0;
+        auto start=std::chrono::steady_clock::now();
+        while (n<(1<<23)) {
+            for (auto &name:fields) sum+=f(name);
+            n+=fields.size();
+        }
+        double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        sink=sink+sum;
+        return seconds*1e9/n;
+    };
+    double table=time([](const std::string &name) { int id=get_warc_field_id(name); return id+get_warc_field_name(id).size(); });
+    double scan=time([&](const std::string &name) {
+        int id=linear(name);
+        for (int i=0; i<WARC_FIELD_COUNT; i++) if (WARC_FIELDS[i].id==id) return id+std::string(names[i]).size();
+        return size_t(id);
+    });
+    return {table,scan};
+}
 
-int main(int argc, char **argv) {
-    if (argc<4 || (argv[1][0]!='e' && argv[1][0]!='d' && argv[1][0]!='l')  ) {
-        printf("warc_f v0.1 (C) 2025 Kaido Orav \nUsage: e[s]|d[m]|l input output\n"), exit(1);
+// Benchmark (mode b). Runs e, d, es, dm and l on input in directory
+// output.work, checks that d and dm restore the input and writes timings
+// as JSON to output. Returns false if a round trip failed.
+inline bool BenchWARC(std::string input, std::string output, const Options &opt) {
+    struct Phase {
+        std::string mode;
+        double seconds;
+        size_t size;
+        int ok;     // round trip, -1 if not checked
+    };
+    char *path=realpath(input.c_str(),NULL);
+    if (path==NULL) fail("Input file not found: %s",input.c_str());
+    input=path;
+    free(path);
+    char cwd[4096];
+    if (getcwd(cwd,sizeof(cwd))==NULL) cwd[0]=0;
+    if (output[0]!='/') output=std::string(cwd)+"/"+output;
+    std::string work=output+".work";
+    mkdir(work.c_str(),0755);
+    if (chdir(work.c_str())!=0) fail("Can not create %s",work.c_str());
+    std::vector<Phase> phases;
+    size_t records=0;
+    auto run=[&](const char *mode, std::string in, std::string out, bool ms, std::function<void(WarcFile &)> f) {
+        auto start=std::chrono::steady_clock::now();
+        {
+            WarcFile file(in,out,ms,opt);
+            f(file);
+        }
+        double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        struct stat st;
+        phases.push_back({mode,seconds,stat(out.c_str(),&st)==0?size_t(st.st_size):0,-1});
+    };
+    run("e",input,"enc",false,[](WarcFile &f) { f.EncodeWARC(); });
+    run("d","enc","dec",false,[](WarcFile &f) { f.DecodeWARC(); });
+    phases.back().ok=sameContent(input,"dec");
+    run("es",input,"split",true,[](WarcFile &f) { f.EncodeWARC(); });
+    run("dm","split","mdec",true,[](WarcFile &f) { f.DecodeWARC(); });
+    phases.back().ok=sameContent(input,"mdec");
+    run("l",input,"list",false,[&](WarcFile &f) {
+        records=f.ListWARC({WARC_TARGET_URI});
+    });
+    size_t fields=0;
+    std::pair<double,double> lookup=benchFieldLookup(input,fields);
+    size_t bytes=phases[1].size;
+    bool ok=phases[1].ok==1 && phases[3].ok==1;
+    FILE *out=fopen(output.c_str(),"wb");
+    if (out==NULL) fail("Can not create %s",output.c_str());
+    fprintf(out,"{\"input\":%s,\"bytes\":%zu,\"records\":%zu,\"threads\":%d,\"pack\":%s,\"dedup\":%s,\"normalize\":%s,\"columns\":%s,\"pipeline\":%s,\"ok\":%s,\"phases\":[",
+        jsonString(input).c_str(),bytes,records,opt.threads,opt.pack?"true":"false",opt.dedup?"true":"false",opt.normalize?"true":"false",
+        opt.columns?"true":"false",opt.pipeline?"true":"false",ok?"true":"false");
+    for (size_t i=0; i<phases.size(); i++) {
+        Phase &p=phases[i];
+        double s=std::max(p.seconds,1e-9);
+        fprintf(out,"%s\n {\"mode\":\"%s\",\"seconds\":%.6f,\"mb_per_s\":%.2f,\"records_per_s\":%.1f,\"output_bytes\":%zu",
+            i>0?",":"",p.mode.c_str(),p.seconds,bytes/s/1e6,records/s,p.size);
+        if (p.ok!=-1) fprintf(out,",\"roundtrip\":%s",p.ok?"true":"false");
+        fprintf(out,"}");
+        printf("%-2s %8.3f s %8.2f MB/s%s\n",p.mode.c_str(),p.seconds,bytes/s/1e6,p.ok==0?" round trip failed":"");
     }
-    bool mergesplit=false;
-    if (argv[1][0]=='e' && argv[1][1]=='s') mergesplit=true;
-    else if (argv[1][0]=='d' && argv[1][1]=='m') mergesplit=true;
-    WarcFile file(argv[2],argv[3],mergesplit);
+    fprintf(out,"\n],\"field_lookup\":{\"fields\":%zu,\"ns_per_field\":%.2f,\"linear_ns_per_field\":%.2f}}\n",fields,lookup.first,lookup.second);
+    fclose(out);
+    printf("field lookup %.2f ns, linear scan %.2f ns per field\n",lookup.first,lookup.second);
+    // work files are kept when a round trip failed
+    if (ok && chdir(cwd)==0) removeDir(work);
+    return ok;
+}
+}
 
-    if (argv[1][0]=='e') {
+#ifndef WARC_F_LIBRARY
+using namespace warcfile;
+
+// Run mode (e, es, d, dm, i, l{n}, x, v) on one input, returns number of records
+int runMode(std::string mode, std::string input, std::string output, const Options &opt, std::string key="") {
+    bool mergesplit=false;
+    if (mode[0]=='e' && mode[1]=='s') mergesplit=true;
+    else if (mode[0]=='d' && mode[1]=='m') mergesplit=true;
+    Options o=opt;
+    o.offsets=mode[0]=='i';
+    WarcFile file(input,output,mergesplit,o);
+    if (mode[0]=='e') {
         // encoding
-        while (file.ReadRecord());
-        file.EncodeWARC();
-    } else if (argv[1][0]=='d') {
+        return file.EncodeWARC();
+    } else if (mode[0]=='d') {
         // decoding
-        while (file.DecodeWARC());
-    } else if (argv[1][0]=='l') {
-        int field=WARC_TARGET_URI;
-        if (argv[1][1]>='0' && argv[1][1]<='9') field=std::stoi(&argv[1][1]);
-        if (field>WARC_RESOURCE_TYPE) field=WARC_TARGET_URI;
-        // read WARC headers only
-        while (file.ReadRecord(false));
-        // list target uri
-        file.ListWARC(field);
-    }
-    return 0;
+        return file.DecodeWARC();
+    } else if (mode[0]=='i') {
+        return file.IndexWARC();
+    } else if (mode[0]=='x') {
+        return file.ExtractWARC(key);
+    } else if (mode[0]=='v') {
+        return file.VerifyWARC();
+    }
+    // l{n[,n...]}, fields by id or name, default target uri
+    std::vector<int> list;
+    for (size_t p=1,e; p<mode.size(); p=e+1) {
+        e=std::min(mode.find(',',p),mode.size());
+        std::string name=mode.substr(p,e-p);
+        bool number=name.size()>0 && name[0]>='0' && name[0]<='9';
+        if (name.size()==0 || (number && atoi(name.c_str())>WARC_RESOURCE_TYPE)) fail("Unknown field %s",name.c_str());
+        int field=number?atoi(name.c_str()):file.FieldId(name);
+        list.push_back(field);
+    }
+    if (list.size()==0) list.push_back(WARC_TARGET_URI);
+    return file.ListWARC(list);
+}
+
+// Inputs of batch mode from @list file, directory or glob pattern.
+// Empty for a single input file.
+std::vector<std::string> batchInputs(std::string input) {
+    std::vector<std::string> inputs;
+    struct stat st;
+    // skip pack files and spool files of es and e output
+    auto part=[](std::string_view n) {
+        n=n.substr(n.rfind('/')+1);
+        return n.find(".pack")!=std::string_view::npos || (n.size()>5 && n.substr(n.size()-5)==".ptab") || (n.size()>4 && n.substr(n.size()-4)==".tmp");
+    };
+    // an existing file is one input even if its name looks like a pattern
+    if (stat(input.c_str(),&st)==0 && S_ISREG(st.st_mode)) return inputs;
+    if (input[0]=='@') {
+        std::string list=readFile(input.substr(1));
+        for (size_t p=0,e; p<list.size(); p=e+1) {
+            e=std::min(list.find('\n',p),list.size());
+            std::string name=list.substr(p,e-p);
+            if (name.size()>0 && name.back()=='\r') name.pop_back();
+            // names that are not found are kept and fail
+            if (name.size()>0 && (stat(name.c_str(),&st)!=0 || S_ISREG(st.st_mode))) inputs.push_back(name);
+        }
+        if (inputs.size()==0) fail("No input files in %s",input.c_str()+1);
+    } else if (stat(input.c_str(),&st)==0 && S_ISDIR(st.st_mode)) {
+        DIR *dir=opendir(input.c_str());
+        struct dirent *e;
+        while (dir!=NULL && (e=readdir(dir))!=NULL) {
+            std::string name=input+"/"+e->d_name;
+            if (e->d_name[0]!='.' && part(e->d_name)==false && stat(name.c_str(),&st)==0 && S_ISREG(st.st_mode)) inputs.push_back(name);
+        }
+        if (dir!=NULL) closedir(dir);
+        std::sort(inputs.begin(),inputs.end());
+        if (inputs.size()==0) fail("No input files in %s",input.c_str());
+    } else if (input.find_first_of("*?[")!=std::string::npos) {
+        glob_t g;
+        if (glob(input.c_str(),0,NULL,&g)==0) {
+            for (size_t k=0; k<g.gl_pathc; k++) {
+                const char *name=g.gl_pathv[k];
+                if (part(name)==false && stat(name,&st)==0 && S_ISREG(st.st_mode)) inputs.push_back(name);
+            }
+        }
+        globfree(&g);
+        if (inputs.size()==0) fail("No input files match %s",input.c_str());
+    }
+    return inputs;
+}
+
+// Batch mode. Files are run by -j N workers taking the next file when done,
+// largest files first so that small files fill the tail. Files started at
+// the tail get the threads of idle workers. Output of each file is
+// output/{input file name}, {name}.{index} if names clash, split files of es
+// go to output/{name}.d/ and l output of all files is merged to output in
+// input order.
+// Returns number of failed files.
+int BatchWARC(std::string mode, const std::vector<std::string> &inputs, std::string output, const Options &opt) {
+    struct Result {
+        int records=0;
+        double seconds=0;
+        std::string error;
+    };
+    bool list=mode[0]=='l';
+    if (list==false) mkdir(output.c_str(),0755);
+    // l output - goes to stdout, parts to the temporary directory and the report to stderr
+    std::string parts=output=="-"?std::string(P_tmpdir)+"/warc_f."+std::to_string(getpid()):output;
+    FILE *report=list && output=="-"?stderr:stdout;
+    std::vector<Result> results(inputs.size());
+    std::vector<std::pair<off_t,size_t>> order;
+    for (size_t k=0; k<inputs.size(); k++) {
+        struct stat st;
+        order.push_back({stat(inputs[k].c_str(),&st)==0?st.st_size:0,k});
+    }
+    std::sort(order.begin(),order.end(),[](auto &a, auto &b) { return a.first>b.first; });
+    // output names, inputs with the same file name get their index appended
+    std::vector<std::string> names(inputs.size());
+    std::map<std::string,int> seen;
+    for (size_t k=0; k<inputs.size(); k++) seen[inputs[k].substr(inputs[k].rfind('/')+1)]++;
+    for (size_t k=0; k<inputs.size(); k++) {
+        names[k]=inputs[k].substr(inputs[k].rfind('/')+1);
+        if (seen[names[k]]>1) names[k]+="."+std::to_string(k);
+    }
+    int workers=opt.threads>0?opt.threads:DefaultThreads();
+    std::atomic<int> remaining(inputs.size());
+    {
+        ThreadPool pool(workers);
+        for (auto &o:order) {
+            size_t k=o.second;
+            pool.Run([&,k] {
+                Options fileopt=opt;
+                fileopt.threads=std::max(1,workers/std::max(1,std::min(workers,remaining.load())));
+                std::string out=list?parts+".part"+std::to_string(k):output+"/"+names[k];
+                if (mode=="es" && opt.pack==false) fileopt.dir=out+".d/",mkdir(fileopt.dir.c_str(),0755);
+                else if (mode=="dm") fileopt.dir=inputs[k]+".d/";
+                auto start=std::chrono::steady_clock::now();
+                try {
+                    results[k].records=runMode(mode,inputs[k],out,fileopt);
+                    if (results[k].records==0) fail("No WARC records");
+                } catch (std::exception &e) {
+                    results[k].error=e.what();
+                    // digest report of v is kept
+                    if (mode!="v") remove(out.c_str());
+                    remove((out+".tmp").c_str());
+                    remove((out+".hdr.tmp").c_str());
+                    if (mode=="es" && opt.pack==false) removeDir(fileopt.dir);
+                    else if (mode=="es") {
+                        // packs are named out.hdr.pack and out.pack{ext}
+                        std::string dir=output+"/",prefix=names[k]+".";
+                        DIR *d=opendir(dir.c_str());
+                        struct dirent *e;
+                        while (d!=NULL && (e=readdir(d))!=NULL) {
+                            std::string_view n(e->d_name);
+                            if (n.substr(0,prefix.size())==prefix && (n.find(".pack")==names[k].size() || n==prefix+"ptab" || n==prefix+"hdr.pack")) unlink((dir+e->d_name).c_str());
+                        }
+                        if (d!=NULL) closedir(d);
+                    }
+                }
+                results[k].seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+                remaining--;
+            });
+        }
+        pool.Wait();
+    }
+    FILE *out=list?(output=="-"?stdout:fopen(output.c_str(),"wb")):NULL;
+    if (list && out==NULL) fail("Can not create %s",output.c_str());
+    int failed=0;
+    for (size_t k=0; k<inputs.size(); k++) {
+        if (results[k].error.size()>0) {
+            fprintf(stderr,"%s: error: %s\n",inputs[k].c_str(),results[k].error.c_str());
+            failed++;
+        } else fprintf(report,"%s: %d records, %.3f s\n",inputs[k].c_str(),results[k].records,results[k].seconds);
+        if (list) {
+            std::string part=parts+".part"+std::to_string(k);
+            copyFile(part,out);
+            remove(part.c_str());
+        }
+    }
+    if (out!=NULL && out!=stdout) fclose(out);
+    fprintf(report,"Files: %d, failed: %d\n",int(inputs.size()),failed);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    int a=1;
+    // options
+    while (a<argc && argv[a][0]=='-') {
+        if (strcmp(argv[a],"-j")==0 && a+1<argc) opt.threads=atoi(argv[++a]);
+        else if (strcmp(argv[a],"-p")==0) opt.pack=true;
+        else if (strcmp(argv[a],"-u")==0) opt.dedup=true;
+        else if (strcmp(argv[a],"-n")==0) opt.normalize=true;
+        else if (strcmp(argv[a],"-c")==0) opt.columns=true;
+        else if (strcmp(argv[a],"-s")==0) opt.pipeline=false;
+        else if (strcmp(argv[a],"--stats")==0 && a+1<argc) opt.stats=argv[++a];
+        else if (strcmp(argv[a],"--verify")==0 && a+1<argc) opt.verify=argv[++a];
+        else if (strcmp(argv[a],"--records")==0 && a+1<argc) opt.records=argv[++a];
+        else if (strcmp(argv[a],"--ids")==0 && a+1<argc) opt.ids=argv[++a];
+        else if (strcmp(argv[a],"--type")==0 && a+1<argc) opt.filter.type=argv[++a];
+        else if (strcmp(argv[a],"--mime")==0 && a+1<argc) opt.filter.mime=argv[++a];
+        else if (strcmp(argv[a],"--status")==0 && a+1<argc) opt.filter.status=argv[++a];
+        else if (strcmp(argv[a],"--uri")==0 && a+1<argc) opt.filter.uri=argv[++a];
+        else argc=0;
+        a++;
+    }
+    argv+=a-1,argc-=a-1;
+    if (argc<4 || strchr("edlixgbv",argv[1][0])==NULL || (argv[1][0]=='x' && argc<5)) {
+        printf("warc_f v0.1 (C) 2025 Kaido Orav \nUsage: [-j N] [-p] [-u] [-n] [-c] [-s] [--stats file] [--verify file] e[s]|d[m]|i input output\n"
+               "       [--type T] [--mime M] [--status S] [--uri U] l[n,...] input output|-\n       [-j N] x index output uri|record-id\n"
+               "       [--records N[-M],...] [--ids file] d input output\n       [-j N] v input output|-\n"
+               "       g n=records,seed=N,... output\n       [-j N] [-p] [-u] [-n] [-c] [-s] b input output.json\n"
+               "input can be @list, a directory or a glob pattern to run a batch of files\n"), exit(1);
+    }
+    try {
+        if (argv[1][0]=='g') {
+            // synthetic input
+            WarcGenerator(parseGenSpec(argv[2])).Write(argv[3]);
+            return 0;
+        } else if (argv[1][0]=='b') {
+            return BenchWARC(argv[2],argv[3],opt)?0:1;
+        }
+        if (opt.stats.size()>0) stats.Start();
+        std::vector<std::string> inputs;
+        if (argv[1][0]!='x') inputs=batchInputs(argv[2]);
+        int failed=0;
+        if (inputs.size()>0) failed=BatchWARC(argv[1],inputs,argv[3],opt);
+        else {
+            int n=runMode(argv[1],argv[2],argv[3],opt,argc>4?argv[4]:"");
+            if (strcmp(argv[3],"-")!=0) printf("Records: %d\n ",n);
+        }
+        if (opt.stats.size()>0) stats.Write(opt.stats,argv[1],argv[2]);
+        return failed>0?1:0;
+    } catch (std::exception &e) {
+        fprintf(stderr,"%s\n",e.what());
+        return 1;
+    }
 }
+#endif